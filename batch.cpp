@@ -0,0 +1,483 @@
+/**
+ * @file batch.cpp
+ * Applies the same TripleTree operations to many PNGs, several images at a
+ * time.
+ *
+ * Usage: batch -o outdir [--jobs N] [--mem MB] [--list files.txt]
+ *              [--metric rgba|euclidean|luma|lab] [--prune tol]
+ *              [--prune-variance tol] [--psnr dB] [--flip] [--rotate N]
+ *              [--scale f] input ...
+ *
+ * Inputs are PNG files or directories, whose .png files are processed in
+ * name order. --list reads one more input per line. Operations run in the
+ * order they are given on every image, then the tree is rendered at
+ * --scale times its size and written to outdir under the input's file
+ * name; inputs that share a file name are refused rather than overwritten.
+ * --metric picks the color metric (see colormetric.h) of the
+ * --prune options after it; tol is in that metric's units.
+ * --prune-variance prunes by mean squared error instead (see
+ * TripleTree::PruneByVariance), and --psnr prunes as far as a target
+ * PSNR allows (see TripleTree::PruneToQuality).
+ *
+ * Each image passes through three stages: decode, tree (build, operations
+ * and render) and encode, joined by queues of at most --jobs images. The
+ * --jobs worker threads (default: one per core) are not tied to a stage:
+ * each one runs the latest stage that has work, so decoding image k + 1,
+ * the tree work on image k and encoding image k - 1 overlap, and no core
+ * idles while a slow stage has a backlog. A new image is only decoded
+ * once the decode queue has room and an estimate of its peak memory,
+ * read from its PNG header, fits in three quarters of a budget of --mem
+ * megabytes (default: half of physical memory). An image larger than that
+ * still runs, alone. The last quarter is the buffer pool's (see
+ * cs221util/BufferPool.h): pixel buffers of finished images are kept
+ * there, up to that share, and reused by later decodes.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tripletree.h"
+#include "cs221util/BufferPool.h"
+#include "cs221util/lodepng/lodepng.h"
+
+using namespace std;
+
+/**
+ * One step applied to every tree, in command-line order.
+ */
+struct Operation {
+	enum Kind { PRUNE, PRUNE_VARIANCE, PRUNE_QUALITY, FLIP, ROTATE } kind;
+	double value; // tolerance for PRUNE and PRUNE_VARIANCE, PSNR for PRUNE_QUALITY, number of quarter turns for ROTATE
+	enum Metric { RGBA, EUCLIDEAN, LUMA, LAB } metric; // for PRUNE
+};
+
+struct BatchOptions {
+	vector<string> inputs;
+	string outDir;
+	vector<Operation> ops;
+	double scale;
+	unsigned int jobs;
+	uint64_t memLimit;  // memory images in flight may reserve, --mem less the pool's share
+};
+
+/**
+ * One image on its way through the pipeline.
+ */
+struct Job {
+	size_t index;   // position in the file list
+	uint64_t bytes; // memory reserved from the budget
+	PNG image;      // decoded input, then the render
+	string report;
+};
+
+bool IsPng(const string& name) {
+	if (name.size() < 4) {
+		return false;
+	}
+	string ext = name.substr(name.size() - 4);
+	transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+	return ext == ".png";
+}
+
+/**
+ * Adds path to files if it is a file, or its .png files in name order if
+ * it is a directory.
+ * @return false, if path does not exist.
+ */
+bool CollectInputs(const string& path, vector<string>& files) {
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) {
+		cerr << "batch: cannot find " << path << endl;
+		return false;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		files.push_back(path);
+		return true;
+	}
+	DIR* dir = opendir(path.c_str());
+	if (dir == nullptr) {
+		cerr << "batch: cannot read directory " << path << endl;
+		return false;
+	}
+	vector<string> found;
+	while (struct dirent* entry = readdir(dir)) {
+		string name = entry->d_name;
+		if (IsPng(name)) {
+			found.push_back(path + "/" + name);
+		}
+	}
+	closedir(dir);
+	sort(found.begin(), found.end());
+	files.insert(files.end(), found.begin(), found.end());
+	return true;
+}
+
+/**
+ * Estimates the peak memory of processing one image from its PNG header:
+ * the decoded bytes, the PNG, the tree at about 1.5 nodes per pixel, the
+ * render and the bytes to encode.
+ * @return 0, if the header cannot be read; decoding will report why.
+ */
+uint64_t EstimateBytes(const string& path, double scale) {
+	unsigned char header[33];
+	ifstream in(path.c_str(), ios::binary);
+	if (!in.read((char*) header, sizeof(header))) {
+		return 0;
+	}
+	unsigned int w = 0, h = 0;
+	LodePNGState state;
+	lodepng_state_init(&state);
+	unsigned int error = lodepng_inspect(&w, &h, &state, header, sizeof(header));
+	lodepng_state_cleanup(&state);
+	if (error) {
+		return 0;
+	}
+	double out = max(1.0, scale * scale);
+	double perPixel = 4 + sizeof(RGBAPixel) + 1.5 * sizeof(Node) + out * (sizeof(RGBAPixel) + 4);
+	return (uint64_t) ((double) w * h * perPixel);
+}
+
+/**
+ * Returns where the result for input is written.
+ */
+string OutputPath(const BatchOptions& opts, const string& input) {
+	size_t slash = input.find_last_of('/');
+	return opts.outDir + "/" + (slash == string::npos ? input : input.substr(slash + 1));
+}
+
+/**
+ * Decode stage: reads the input of job into job.image, whose pixel buffer
+ * is reused if it already has the right size.
+ * @return false, if the image could not be read.
+ */
+bool Decode(Job& job, const string& input) {
+	if (!job.image.readFromFile(input)) {
+		return false;
+	}
+	if (job.image.width() == 0 || job.image.height() == 0) {
+		cerr << "batch: " << input << " is empty" << endl;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Tree stage: builds the tree, applies every operation, and replaces
+ * job.image with the render.
+ */
+void Process(Job& job, const BatchOptions& opts) {
+	auto start = chrono::steady_clock::now();
+	unsigned int w = job.image.width();
+	unsigned int h = job.image.height();
+	// a leading default-metric prune is fused into the build, which never
+	// creates the nodes it would delete
+	size_t first = 0;
+	bool fused = !opts.ops.empty() && opts.ops[0].kind == Operation::PRUNE && opts.ops[0].metric == Operation::RGBA;
+	TripleTree t = fused ? TripleTree(job.image, opts.ops[first++].value) : TripleTree(job.image);
+	// the tree holds everything needed from here on
+	job.image = PNG();
+
+	for (size_t k = first; k < opts.ops.size(); k++) {
+		const Operation& op = opts.ops[k];
+		if (op.kind == Operation::PRUNE) {
+			if (op.metric == Operation::EUCLIDEAN) {
+				t.Prune<EuclideanRGB>(op.value);
+			} else if (op.metric == Operation::LUMA) {
+				t.Prune<LumaWeightedRGB>(op.value);
+			} else if (op.metric == Operation::LAB) {
+				t.Prune<CIELab76>(op.value);
+			} else {
+				t.Prune(op.value);
+			}
+		} else if (op.kind == Operation::PRUNE_VARIANCE) {
+			t.PruneByVariance(op.value);
+		} else if (op.kind == Operation::PRUNE_QUALITY) {
+			t.PruneToQuality(op.value);
+		} else if (op.kind == Operation::FLIP) {
+			t.FlipHorizontal();
+		} else {
+			int turns = ((int) op.value % 4 + 4) % 4;
+			for (int i = 0; i < turns; i++) {
+				t.RotateCCW();
+				swap(w, h);
+			}
+		}
+	}
+
+	if (opts.scale == 1.0) {
+		job.image = t.Render();
+	} else {
+		job.image = t.Render(max(1u, (unsigned int) lround(w * opts.scale)), max(1u, (unsigned int) lround(h * opts.scale)));
+	}
+
+	stringstream line;
+	line << job.image.width() << "x" << job.image.height() << ", " << t.NumLeaves() << " leaves, tree "
+		<< chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s";
+	job.report = line.str();
+}
+
+/**
+ * Encode stage: writes the render of job.
+ * @return false, if the image could not be written.
+ */
+bool Encode(Job& job, const string& output) {
+	return job.image.writeToFile(output);
+}
+
+/**
+ * The decode, tree and encode stages and the queues between them. All
+ * state is guarded by one mutex, which is only held to move jobs between
+ * queues; the stages themselves run unlocked.
+ */
+class Pipeline {
+public:
+	Pipeline(const vector<string>& files, const BatchOptions& opts)
+		: files(files), opts(opts), capacity(opts.jobs), next(0), decoding(0), processing(0), finished(0),
+		  failures(0), memUsed(0), nextBytes(0), nextEstimated(false) { }
+
+	/**
+	 * Runs stages until every image has been written or has failed.
+	 * Called by every worker thread.
+	 */
+	void Work() {
+		unique_lock<mutex> lock(m);
+		while (finished < files.size()) {
+			if (!rendered.empty()) {
+				Job job = TakeFront(rendered);
+				lock.unlock();
+				bool ok = Encode(job, OutputPath(opts, files[job.index]));
+				lock.lock();
+				Finish(job, ok);
+			} else if (!decoded.empty() && rendered.size() + processing < capacity) {
+				Job job = TakeFront(decoded);
+				processing++;
+				lock.unlock();
+				Process(job, opts);
+				lock.lock();
+				processing--;
+				rendered.push_back(std::move(job));
+				changed.notify_all();
+			} else if (CanDecode()) {
+				Job job;
+				job.index = next++;
+				job.bytes = nextBytes;
+				nextEstimated = false;
+				memUsed += job.bytes;
+				decoding++;
+				lock.unlock();
+				bool ok = Decode(job, files[job.index]);
+				lock.lock();
+				decoding--;
+				if (ok) {
+					decoded.push_back(std::move(job));
+					changed.notify_all();
+				} else {
+					Finish(job, false);
+				}
+			} else {
+				changed.wait(lock);
+			}
+		}
+	}
+
+	unsigned int Failures() const {
+		return failures;
+	}
+
+private:
+	const vector<string>& files;
+	const BatchOptions& opts;
+	size_t capacity;      // most images waiting in, or being produced for, each queue
+	size_t next;          // next file to decode
+	size_t decoding;
+	size_t processing;    // images in the tree stage
+	size_t finished;      // images written or failed
+	unsigned int failures;
+	uint64_t memUsed;     // memory reserved by images in flight
+	uint64_t nextBytes;   // estimate for files[next], once nextEstimated
+	bool nextEstimated;
+	deque<Job> decoded;   // decode -> tree
+	deque<Job> rendered;  // tree -> encode
+	mutex m;
+	condition_variable changed;
+
+	Job TakeFront(deque<Job>& queue) {
+		Job job = std::move(queue.front());
+		queue.pop_front();
+		changed.notify_all();
+		return job;
+	}
+
+	bool CanDecode() {
+		if (next >= files.size() || decoded.size() + decoding >= capacity) {
+			return false;
+		}
+		if (!nextEstimated) {
+			// only reads the PNG header, so it is cheap enough to do locked
+			nextBytes = EstimateBytes(files[next], opts.scale);
+			nextEstimated = true;
+		}
+		return memUsed == 0 || memUsed + nextBytes <= opts.memLimit;
+	}
+
+	void Finish(Job& job, bool ok) {
+		if (ok) {
+			cout << files[job.index] << " -> " << OutputPath(opts, files[job.index]) << ": " << job.report << endl;
+		} else {
+			cerr << "batch: failed on " << files[job.index] << endl;
+			failures++;
+		}
+		job.image = PNG();
+		memUsed -= job.bytes;
+		finished++;
+		changed.notify_all();
+	}
+};
+
+void Usage(const char* name) {
+	cerr << "usage: " << name << " -o outdir [--jobs N] [--mem MB] [--list files.txt]"
+		<< " [--metric rgba|euclidean|luma|lab] [--prune tol] [--prune-variance tol]"
+		<< " [--psnr dB] [--flip] [--rotate N] [--scale f] input ..." << endl;
+}
+
+int main(int argc, char* argv[]) {
+	BatchOptions opts;
+	opts.scale = 1.0;
+	opts.jobs = max(1u, thread::hardware_concurrency());
+	opts.memLimit = (uint64_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE) / 2;
+	Operation::Metric metric = Operation::RGBA;
+
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "-o" && hasValue) {
+			opts.outDir = argv[++i];
+		} else if (arg == "--jobs" && hasValue) {
+			opts.jobs = max(1, atoi(argv[++i]));
+		} else if (arg == "--mem" && hasValue) {
+			opts.memLimit = (uint64_t) max(1.0, atof(argv[++i])) << 20;
+		} else if (arg == "--list" && hasValue) {
+			ifstream list(argv[++i]);
+			if (!list) {
+				cerr << "batch: cannot read list " << argv[i] << endl;
+				return 1;
+			}
+			string line;
+			while (getline(list, line)) {
+				if (!line.empty()) {
+					opts.inputs.push_back(line);
+				}
+			}
+		} else if (arg == "--metric" && hasValue) {
+			string name = argv[++i];
+			if (name == "rgba") {
+				metric = Operation::RGBA;
+			} else if (name == "euclidean") {
+				metric = Operation::EUCLIDEAN;
+			} else if (name == "luma") {
+				metric = Operation::LUMA;
+			} else if (name == "lab") {
+				metric = Operation::LAB;
+			} else {
+				Usage(argv[0]);
+				return 1;
+			}
+		} else if (arg == "--prune" && hasValue) {
+			opts.ops.push_back(Operation{ Operation::PRUNE, atof(argv[++i]), metric });
+		} else if (arg == "--prune-variance" && hasValue) {
+			opts.ops.push_back(Operation{ Operation::PRUNE_VARIANCE, atof(argv[++i]), metric });
+		} else if (arg == "--psnr" && hasValue) {
+			opts.ops.push_back(Operation{ Operation::PRUNE_QUALITY, atof(argv[++i]), metric });
+		} else if (arg == "--flip") {
+			opts.ops.push_back(Operation{ Operation::FLIP, 0, metric });
+		} else if (arg == "--rotate" && hasValue) {
+			opts.ops.push_back(Operation{ Operation::ROTATE, (double) atoi(argv[++i]), metric });
+		} else if (arg == "--scale" && hasValue) {
+			opts.scale = atof(argv[++i]);
+		} else if (!arg.empty() && arg[0] != '-') {
+			opts.inputs.push_back(arg);
+		} else {
+			Usage(argv[0]);
+			return 1;
+		}
+	}
+	if (opts.outDir.empty() || opts.inputs.empty() || opts.scale <= 0) {
+		Usage(argv[0]);
+		return 1;
+	}
+#ifdef __GLIBC__
+	// every image frees and reallocates the same amounts of memory; keep it
+	// instead of returning it to the kernel and faulting it back in
+	mallopt(M_TRIM_THRESHOLD, 1 << 30);
+	mallopt(M_MMAP_THRESHOLD, 32 << 20);
+#endif
+	// freed buffers are cached within a quarter of the budget, so that they
+	// and the images in flight together stay within it
+	uint64_t poolShare = opts.memLimit / 4;
+	BufferPool::setLimit(poolShare);
+	opts.memLimit -= poolShare;
+
+	vector<string> files;
+	bool ok = true;
+	for (const string& input : opts.inputs) {
+		ok = CollectInputs(input, files) && ok;
+	}
+	// outputs are named after the input alone, so a/x.png and b/x.png would collide
+	map<string, string> outputs;
+	for (const string& file : files) {
+		auto inserted = outputs.insert(make_pair(OutputPath(opts, file), file));
+		if (!inserted.second) {
+			cerr << "batch: " << inserted.first->second << " and " << file << " would both be written to "
+				<< inserted.first->first << endl;
+			return 1;
+		}
+	}
+	if (mkdir(opts.outDir.c_str(), 0755) != 0) {
+		struct stat st;
+		int error = errno;
+		if (error != EEXIST || stat(opts.outDir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+			cerr << "batch: cannot create output directory " << opts.outDir << ": "
+				<< strerror(error == EEXIST ? ENOTDIR : error) << endl;
+			return 1;
+		}
+	}
+
+	Pipeline pipeline(files, opts);
+	auto start = chrono::steady_clock::now();
+	vector<thread> workers;
+	for (unsigned int j = 1; j < min<size_t>(opts.jobs, files.size()); j++) {
+		workers.push_back(thread(&Pipeline::Work, &pipeline));
+	}
+	pipeline.Work();
+	for (thread& t : workers) {
+		t.join();
+	}
+	unsigned int failures = pipeline.Failures();
+
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cerr << files.size() - failures << " of " << files.size() << " images in " << seconds << " s ("
+		<< (seconds > 0 ? (files.size() - failures) / seconds : 0) << " images/s, " << opts.jobs << " jobs)" << endl;
+	return (ok && failures == 0) ? 0 : 1;
+}
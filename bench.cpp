@@ -0,0 +1,463 @@
+/**
+ * @file bench.cpp
+ * Benchmarks building, pruning, transforming and rendering TripleTrees, and
+ * PNG encode/decode to files and in memory, on synthetic images of
+ * increasing size. Prune runs with every metric in colormetric.h, and
+ * PruneByVariance at tol / 10.
+ *
+ * Usage: bench [--sizes 1,4,16 | --full] [--kinds noise,gradient,flat,photo]
+ *              [--tol 0.05] [--repeat 1] [--no-io] [--tmp /tmp]
+ *              [--image file.png ...]
+ *
+ * Sizes are in megapixels. The defaults run in a few minutes; --full
+ * sweeps 1, 4, 16, 64 and 100 MP, which needs several gigabytes of memory
+ * for the largest cases. Prune phases prune a freshly built tree, so they
+ * do not pay for cloning nodes shared with another tree. Results are
+ * written to stdout as JSON, progress to stderr. Every case runs in its
+ * own child process, so peak_rss_kb is the peak resident set of that case
+ * alone. Built with make STATS=1, each case also carries the trees'
+ * TreeStats counters.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "tripletree.h"
+#include "sharedtree.h"
+#include "tiledforest.h"
+
+using namespace std;
+
+/**
+ * One image to benchmark: either a synthetic kind at a size in megapixels,
+ * or a PNG file from disk.
+ */
+struct BenchCase {
+	string kind;
+	double megapixels;
+	string path;
+};
+
+struct BenchOptions {
+	vector<BenchCase> cases;
+	double tol;
+	int repeat;
+	bool io;
+	string tmp;
+};
+
+/**
+ * Returns s as a JSON string literal, quotes included.
+ */
+string Quote(const string& s) {
+	stringstream out;
+	out << '"';
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			out << '\\' << c;
+		} else if ((unsigned char) c < 0x20) {
+			char code[8];
+			snprintf(code, sizeof(code), "\\u%04x", c);
+			out << code;
+		} else {
+			out << c;
+		}
+	}
+	out << '"';
+	return out.str();
+}
+
+/**
+ * Accumulates the results of one case as JSON.
+ */
+class BenchResult {
+public:
+	BenchResult(const string& kind, unsigned int w, unsigned int h) {
+		out << "{\"image\": " << Quote(kind) << ", \"width\": " << w << ", \"height\": " << h
+			<< ", \"megapixels\": " << (double) w * h / 1e6;
+		mp = (double) w * h / 1e6;
+	}
+
+	void Count(const string& name, uint64_t value) {
+		out << ", \"" << name << "\": " << value;
+	}
+
+	void Raw(const string& name, const string& json) {
+		out << ", \"" << name << "\": " << json;
+	}
+
+	void Phase(const string& name, double seconds) {
+		phases << (phases.tellp() > 0 ? ", " : "") << "\"" << name << "\": {\"seconds\": " << seconds
+			<< ", \"mp_per_s\": " << (seconds > 0 ? mp / seconds : 0) << "}";
+	}
+
+	string Finish() {
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		out << ", \"peak_rss_kb\": " << usage.ru_maxrss << ", \"phases\": {" << phases.str() << "}}";
+		return out.str();
+	}
+
+private:
+	stringstream out;
+	stringstream phases;
+	double mp;
+};
+
+/**
+ * Runs setup then fn opts.repeat times and returns the fastest wall time
+ * of fn alone, in seconds.
+ */
+template <typename S, typename F>
+double Time(const BenchOptions& opts, S setup, F fn) {
+	double best = 0;
+	for (int i = 0; i < opts.repeat; i++) {
+		setup();
+		auto start = chrono::steady_clock::now();
+		fn();
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		if (i == 0 || seconds < best) {
+			best = seconds;
+		}
+	}
+	return best;
+}
+
+/**
+ * Runs fn opts.repeat times and returns the fastest wall time in seconds.
+ */
+template <typename F>
+double Time(const BenchOptions& opts, F fn) {
+	return Time(opts, []() {}, fn);
+}
+
+/**
+ * Picks a 4:3 image with roughly the requested number of megapixels.
+ */
+void Dimensions(double megapixels, unsigned int& w, unsigned int& h) {
+	double pixels = max(1.0, megapixels * 1e6);
+	w = max(1u, (unsigned int) lround(sqrt(pixels * 4 / 3)));
+	h = max(1u, (unsigned int) lround(pixels / w));
+}
+
+/**
+ * Fills img with a synthetic pattern. "photo" upscales the bundled photo
+ * with bilinear interpolation, which keeps its smooth, natural statistics.
+ * @return false, if the kind is unknown or its source could not be read.
+ */
+bool Generate(const string& kind, PNG& img) {
+	unsigned int w = img.width();
+	unsigned int h = img.height();
+	if (kind == "noise") {
+		mt19937 rng(221);
+		for (unsigned int y = 0; y < h; y++) {
+			RGBAPixel *row = img.getPixel(0, y);
+			for (unsigned int x = 0; x < w; x++) {
+				unsigned int bits = rng();
+				row[x] = RGBAPixel(bits & 0xff, (bits >> 8) & 0xff, (bits >> 16) & 0xff);
+			}
+		}
+	} else if (kind == "gradient") {
+		for (unsigned int y = 0; y < h; y++) {
+			RGBAPixel *row = img.getPixel(0, y);
+			for (unsigned int x = 0; x < w; x++) {
+				row[x] = RGBAPixel(255 * x / w, 255 * y / h, 255 * (x + y) / (w + h));
+			}
+		}
+	} else if (kind == "flat") {
+		for (unsigned int y = 0; y < h; y++) {
+			RGBAPixel *row = img.getPixel(0, y);
+			for (unsigned int x = 0; x < w; x++) {
+				row[x] = RGBAPixel(40, 120, 200);
+			}
+		}
+	} else if (kind == "photo") {
+		PNG src;
+		if (!src.readFromFile("images-original/malachi-60x87.png")) {
+			return false;
+		}
+		for (unsigned int y = 0; y < h; y++) {
+			RGBAPixel *row = img.getPixel(0, y);
+			double sy = min((y + 0.5) * src.height() / h - 0.5, src.height() - 1.0);
+			sy = max(sy, 0.0);
+			unsigned int y0 = (unsigned int) sy;
+			unsigned int y1 = min(y0 + 1, src.height() - 1);
+			double fy = sy - y0;
+			for (unsigned int x = 0; x < w; x++) {
+				double sx = min((x + 0.5) * src.width() / w - 0.5, src.width() - 1.0);
+				sx = max(sx, 0.0);
+				unsigned int x0 = (unsigned int) sx;
+				unsigned int x1 = min(x0 + 1, src.width() - 1);
+				double fx = sx - x0;
+				RGBAPixel *p00 = src.getPixel(x0, y0), *p10 = src.getPixel(x1, y0);
+				RGBAPixel *p01 = src.getPixel(x0, y1), *p11 = src.getPixel(x1, y1);
+				double wt[4] = { (1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy };
+				row[x] = RGBAPixel(
+					(int) (wt[0] * p00->r + wt[1] * p10->r + wt[2] * p01->r + wt[3] * p11->r + 0.5),
+					(int) (wt[0] * p00->g + wt[1] * p10->g + wt[2] * p01->g + wt[3] * p11->g + 0.5),
+					(int) (wt[0] * p00->b + wt[1] * p10->b + wt[2] * p01->b + wt[3] * p11->b + 0.5));
+			}
+		}
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Runs every phase on one image and returns its JSON record, or an empty
+ * string if the image could not be produced.
+ */
+string RunCase(const BenchCase& c, const BenchOptions& opts) {
+	PNG img;
+	string name = c.kind;
+	if (!c.path.empty()) {
+		if (!img.readFromFile(c.path)) {
+			return "";
+		}
+		name = c.path;
+	} else {
+		unsigned int w, h;
+		Dimensions(c.megapixels, w, h);
+		img = PNG(w, h);
+		if (!Generate(c.kind, img)) {
+			return "";
+		}
+	}
+	BenchResult result(name, img.width(), img.height());
+
+	if (opts.io) {
+		stringstream file;
+		file << opts.tmp << "/tripletree-bench-" << getpid() << ".png";
+		result.Phase("png_encode", Time(opts, [&]() { img.writeToFile(file.str()); }));
+		result.Phase("png_decode", Time(opts, [&]() { img.readFromFile(file.str()); }));
+		remove(file.str().c_str());
+		vector<unsigned char> bytes;
+		result.Phase("png_encode_memory", Time(opts, [&]() { bytes = img.encode(); }));
+		result.Phase("png_decode_memory", Time(opts, [&]() { img.decode(bytes); }));
+	}
+
+	TripleTree* t = nullptr;
+	result.Phase("build", Time(opts, [&]() { delete t; }, [&]() { t = new TripleTree(img); }));
+	result.Count("leaves", t->NumLeaves());
+
+	PNG out;
+	result.Phase("render", Time(opts, [&]() { out = t->Render(); }));
+	result.Phase("flip_horizontal", Time(opts, [&]() { t->FlipHorizontal(); }));
+	result.Phase("rotate_ccw", Time(opts, [&]() { t->RotateCCW(); }));
+	TripleTree* copy = nullptr;
+	result.Phase("copy", Time(opts, [&]() { delete copy; }, [&]() { copy = new TripleTree(*t); }));
+	delete copy;
+	// a rotation published to readers: copy, clone every node, swap the snapshot
+	SharedTripleTree shared{ TripleTree(*t) };
+	result.Phase("shared_rotate_ccw", Time(opts, [&]() { shared.Update([](TripleTree& tree) { tree.RotateCCW(); }); }));
+	// one tree per 1024x1024 tile, built and rendered on every core
+	TiledForest* forest = nullptr;
+	result.Phase("build_tiled", Time(opts, [&]() { delete forest; }, [&]() { forest = new TiledForest(img, 1024); }));
+	result.Phase("render_tiled", Time(opts, [&]() { out = forest->Render(); }));
+	delete forest;
+
+	// prunes start from a fresh tree, not a copy sharing t's nodes
+	TripleTree pruned(img);
+	auto fresh = [&]() { pruned = TripleTree(img); };
+	result.Phase("prune", Time(opts, fresh, [&]() { pruned.Prune(opts.tol); }));
+	result.Count("pruned_leaves", pruned.NumLeaves());
+	TripleTree* fused = nullptr;
+	result.Phase("build_pruned", Time(opts, [&]() { delete fused; }, [&]() { fused = new TripleTree(img, opts.tol); }));
+	delete fused;
+	SummedAreaTable* table = nullptr;
+	result.Phase("summed_area", Time(opts, [&]() { delete table; }, [&]() { table = new SummedAreaTable(img); }));
+	TripleTree* summed = nullptr;
+	result.Phase("build_summed", Time(opts, [&]() { delete summed; }, [&]() { summed = new TripleTree(img, *table, -1); }));
+	delete summed;
+	summed = nullptr;
+	result.Phase("build_summed_variance", Time(opts, [&]() { delete summed; }, [&]() { summed = new TripleTree(img, *table, opts.tol / 10); }));
+	result.Count("summed_variance_leaves", summed->NumLeaves());
+	delete summed;
+	// a lazy tree only builds what a thumbnail or viewport looks at
+	TripleTree* lazy = nullptr;
+	result.Phase("lazy_thumbnail", Time(opts, [&]() { delete lazy; lazy = new TripleTree(img, *table, -1, true); },
+		[&]() { out = lazy->Render(img.width() / 16 + 1, img.height() / 16 + 1); }));
+	result.Phase("lazy_region", Time(opts, [&]() { delete lazy; lazy = new TripleTree(img, *table, -1, true); },
+		[&]() { out = lazy->RenderRegion(img.width() / 2, img.height() / 2, img.width() / 8 + 1, img.height() / 8 + 1); }));
+	delete lazy;
+	lazy = nullptr;
+	// panning a viewport across a budgeted tree evicts what scrolled away
+	TripleTree::SetNodeBudget((size_t) img.width() * img.height() / 4 + 1);
+	result.Phase("budget_pan", Time(opts, [&]() { delete lazy; lazy = new TripleTree(img, *table, -1, true); }, [&]() {
+		for (unsigned int i = 0; i < 8; i++) {
+			out = lazy->RenderRegion(img.width() * i / 8, img.height() * i / 8, img.width() / 4 + 1, img.height() / 4 + 1);
+		}
+	}));
+	result.Count("budget_nodes", TripleTree::BudgetedNodes());
+	delete lazy;
+	TripleTree::SetNodeBudget(0);
+	delete table;
+	result.Phase("render_pruned", Time(opts, [&]() { out = pruned.Render(); }));
+#ifdef TRIPLETREE_STATS
+	stringstream treeStats, prunedStats;
+	t->WriteStatsJSON(treeStats);
+	pruned.WriteStatsJSON(prunedStats);
+	result.Raw("tree_stats", treeStats.str());
+	result.Raw("pruned_tree_stats", prunedStats.str());
+#endif
+
+	// the other metrics, at tolerances of about the same strictness as tol
+	double rgbTol = sqrt(opts.tol);
+	result.Phase("prune_euclidean", Time(opts, fresh, [&]() { pruned.Prune<EuclideanRGB>(rgbTol); }));
+	result.Count("pruned_leaves_euclidean", pruned.NumLeaves());
+	result.Phase("prune_luma", Time(opts, fresh, [&]() { pruned.Prune<LumaWeightedRGB>(rgbTol); }));
+	result.Count("pruned_leaves_luma", pruned.NumLeaves());
+	result.Phase("prune_lab", Time(opts, fresh, [&]() { pruned.Prune<CIELab76>(100 * rgbTol); }));
+	result.Count("pruned_leaves_lab", pruned.NumLeaves());
+	// mean squared error of about the same strictness as tol's maximum
+	result.Phase("prune_variance", Time(opts, fresh, [&]() { pruned.PruneByVariance(opts.tol / 10); }));
+	result.Count("pruned_leaves_variance", pruned.NumLeaves());
+	result.Phase("prune_quality", Time(opts, fresh, [&]() { pruned.PruneToQuality(30); }));
+	result.Count("pruned_leaves_quality", pruned.NumLeaves());
+	// the first incremental prune ranks every node; later ones only touch the nodes between tolerances
+	result.Phase("refine_first", Time(opts, [&]() { pruned = TripleTree(img); pruned.SetIncrementalPrune(true); }, [&]() { pruned.Prune(opts.tol); }));
+	result.Phase("refine", Time(opts, [&]() { pruned.Prune(opts.tol); }, [&]() { pruned.Prune(opts.tol / 2); }));
+	result.Count("refined_leaves", pruned.NumLeaves());
+	delete t;
+
+	return result.Finish();
+}
+
+/**
+ * Runs one case in a child process and returns the JSON it reports, or
+ * an error record naming the case, with crashed set, if the child did not
+ * finish, e.g. because it ran out of memory. Runs in this process if no
+ * child can be started.
+ */
+string RunIsolated(const BenchCase& c, const BenchOptions& opts, bool& crashed) {
+	crashed = false;
+	int fds[2];
+	if (pipe(fds) != 0) {
+		return RunCase(c, opts);
+	}
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return RunCase(c, opts);
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		string json = RunCase(c, opts);
+		ssize_t written = write(fds[1], json.data(), json.size());
+		_exit(written == (ssize_t) json.size() ? 0 : 1);
+	}
+	close(fds[1]);
+	string json;
+	char buf[4096];
+	ssize_t n;
+	while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+		json.append(buf, n);
+	}
+	close(fds[0]);
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		crashed = true;
+		stringstream error;
+		error << "{\"image\": " << Quote(c.path.empty() ? c.kind : c.path) << ", \"megapixels\": " << c.megapixels
+			<< ", \"error\": \"" << (WIFSIGNALED(status) ? "killed by signal " + to_string(WTERMSIG(status))
+				: "exited with status " + to_string(WEXITSTATUS(status))) << "\"}";
+		return error.str();
+	}
+	return json;
+}
+
+vector<string> Split(const string& list) {
+	vector<string> parts;
+	stringstream in(list);
+	string part;
+	while (getline(in, part, ',')) {
+		if (!part.empty()) {
+			parts.push_back(part);
+		}
+	}
+	return parts;
+}
+
+int main(int argc, char* argv[]) {
+	BenchOptions opts;
+	opts.tol = 0.05;
+	opts.repeat = 1;
+	opts.io = true;
+	opts.tmp = "/tmp";
+	vector<string> sizes = Split("1,4,16");
+	const char* fullSizes = "1,4,16,64,100";
+	vector<string> kinds = Split("noise,gradient,flat,photo");
+	vector<string> images;
+
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--sizes" && hasValue) {
+			sizes = Split(argv[++i]);
+		} else if (arg == "--full") {
+			sizes = Split(fullSizes);
+		} else if (arg == "--kinds" && hasValue) {
+			kinds = Split(argv[++i]);
+		} else if (arg == "--tol" && hasValue) {
+			opts.tol = atof(argv[++i]);
+		} else if (arg == "--repeat" && hasValue) {
+			opts.repeat = max(1, atoi(argv[++i]));
+		} else if (arg == "--tmp" && hasValue) {
+			opts.tmp = argv[++i];
+		} else if (arg == "--image" && hasValue) {
+			images.push_back(argv[++i]);
+		} else if (arg == "--no-io") {
+			opts.io = false;
+		} else {
+			cerr << "usage: " << argv[0] << " [--sizes 1,4,16 | --full] [--kinds noise,gradient,flat,photo]"
+				<< " [--tol 0.05] [--repeat 1] [--no-io] [--tmp /tmp] [--image file.png ...]" << endl;
+			return 1;
+		}
+	}
+
+	for (const string& size : sizes) {
+		for (const string& kind : kinds) {
+			opts.cases.push_back(BenchCase{ kind, atof(size.c_str()), "" });
+		}
+	}
+	for (const string& path : images) {
+		opts.cases.push_back(BenchCase{ "file", 0, path });
+	}
+
+	cout << "{\"benchmark\": \"tripletree\", \"tol\": " << opts.tol << ", \"repeat\": " << opts.repeat
+		<< ", \"cases\": [";
+	bool first = true;
+	for (const BenchCase& c : opts.cases) {
+		cerr << "Running " << (c.path.empty() ? c.kind : c.path);
+		if (c.path.empty()) {
+			cerr << " at " << c.megapixels << " MP";
+		}
+		cerr << "... ";
+		bool crashed;
+		string json = RunIsolated(c, opts, crashed);
+		if (json.empty()) {
+			cerr << "failed." << endl;
+			continue;
+		}
+		cerr << (crashed ? "crashed." : "done.") << endl;
+		cout << (first ? "\n  " : ",\n  ") << json;
+		first = false;
+	}
+	cout << "\n]}" << endl;
+	return 0;
+}
@@ -0,0 +1,162 @@
+/**
+ * @file        colormetric.h
+ *
+ */
+
+#ifndef _COLORMETRIC_H_
+#define _COLORMETRIC_H_
+
+#include <algorithm>
+#include <cmath>
+
+#include "cs221util/RGBAPixel.h"
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * Color distance metrics for TripleTree::Prune. A metric is a class with
+ *
+ *     typedef ... Color;
+ *     static Color Convert(const RGBAPixel& p);
+ *     static double Distance(const Color& x, const Color& y);
+ *
+ * Prune converts a subtree's average once and each leaf as it is tested,
+ * so a metric can move its expensive work into Convert. Both functions are
+ * inlined into the prune loop; there is no virtual dispatch.
+ */
+
+/**
+ * RGBAPixel::distanceTo: the sum over channels of the larger squared
+ * difference of the premultiplied channel with or without the alpha
+ * difference. Range [0, 3]. This is Prune's default metric.
+ */
+struct RGBADistance {
+    typedef RGBAPixel Color;
+
+    static Color Convert(const RGBAPixel& p) {
+        return p;
+    }
+
+    static double Distance(const Color& x, const Color& y) {
+        double r_diff = (y.r / 255.0) * y.a - (x.r / 255.0) * x.a;
+        double g_diff = (y.g / 255.0) * y.a - (x.g / 255.0) * x.a;
+        double b_diff = (y.b / 255.0) * y.a - (x.b / 255.0) * x.a;
+        double alphadiff = y.a - x.a;
+
+        double maxdiff_r = max(r_diff * r_diff, (r_diff - alphadiff) * (r_diff - alphadiff));
+        double maxdiff_g = max(g_diff * g_diff, (g_diff - alphadiff) * (g_diff - alphadiff));
+        double maxdiff_b = max(b_diff * b_diff, (b_diff - alphadiff) * (b_diff - alphadiff));
+
+        return maxdiff_r + maxdiff_g + maxdiff_b;
+    }
+};
+
+/**
+ * Premultiplied red, green and blue in [0, 1], shared by the RGB metrics.
+ * Premultiplying compares translucent colors as composited over black.
+ */
+struct PremultipliedRGB {
+    double r, g, b;
+};
+
+inline PremultipliedRGB Premultiply(const RGBAPixel& p) {
+    return PremultipliedRGB{ (p.r / 255.0) * p.a, (p.g / 255.0) * p.a, (p.b / 255.0) * p.a };
+}
+
+/**
+ * Straight-line distance between premultiplied RGB colors. Range [0, sqrt(3)].
+ */
+struct EuclideanRGB {
+    typedef PremultipliedRGB Color;
+
+    static Color Convert(const RGBAPixel& p) {
+        return Premultiply(p);
+    }
+
+    static double Distance(const Color& x, const Color& y) {
+        double dr = x.r - y.r, dg = x.g - y.g, db = x.b - y.b;
+        return sqrt(dr * dr + dg * dg + db * db);
+    }
+};
+
+/**
+ * Euclidean distance with each channel weighted by its share of luma
+ * (Rec. 601), so green differences count most and blue least. Range [0, 1].
+ */
+struct LumaWeightedRGB {
+    typedef PremultipliedRGB Color;
+
+    static Color Convert(const RGBAPixel& p) {
+        return Premultiply(p);
+    }
+
+    static double Distance(const Color& x, const Color& y) {
+        double dr = x.r - y.r, dg = x.g - y.g, db = x.b - y.b;
+        return sqrt(0.299 * dr * dr + 0.587 * dg * dg + 0.114 * db * db);
+    }
+};
+
+/**
+ * CIE 1976 color difference (delta E*ab): Euclidean distance in CIELAB
+ * under D65, where a difference of about 2.3 is just noticeable. Range
+ * roughly [0, 150]. sRGB decoding and the cube root of the Lab transfer
+ * function both go through lookup tables, the latter interpolated, so
+ * Convert is table lookups and one small matrix product, and colors land
+ * within 0.003 of their exact Lab values.
+ */
+struct CIELab76 {
+    struct Color {
+        double L, a, b;
+    };
+
+    static Color Convert(const RGBAPixel& p) {
+        const Table& table = Tables();
+        double r = table.linear[p.r] * p.a;
+        double g = table.linear[p.g] * p.a;
+        double b = table.linear[p.b] * p.a;
+        double fx = table.F((0.4124564 * r + 0.3575761 * g + 0.1804375 * b) / 0.95047);
+        double fy = table.F(0.2126729 * r + 0.7151522 * g + 0.0721750 * b);
+        double fz = table.F((0.0193339 * r + 0.1191920 * g + 0.9503041 * b) / 1.08883);
+        return Color{ 116 * fy - 16, 500 * (fx - fy), 200 * (fy - fz) };
+    }
+
+    static double Distance(const Color& x, const Color& y) {
+        double dL = x.L - y.L, da = x.a - y.a, db = x.b - y.b;
+        return sqrt(dL * dL + da * da + db * db);
+    }
+
+private:
+    static const int STEPS = 4096;
+
+    struct Table {
+        double linear[256];   // sRGB channel value to linear light
+        double f[STEPS + 1];  // Lab transfer function at t = i / STEPS
+
+        Table() {
+            for (int i = 0; i < 256; i++) {
+                double c = i / 255.0;
+                linear[i] = (c <= 0.04045) ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+            }
+            const double delta = 6.0 / 29.0;
+            for (int i = 0; i <= STEPS; i++) {
+                double t = (double) i / STEPS;
+                f[i] = (t > delta * delta * delta) ? cbrt(t) : t / (3 * delta * delta) + 4.0 / 29.0;
+            }
+        }
+
+        // t is in [0, 1] up to rounding, as every color is at most white
+        double F(double t) const {
+            double s = min(max(t, 0.0), 1.0) * STEPS;
+            int i = min((int) s, STEPS - 1);
+            return f[i] + (f[i + 1] - f[i]) * (s - i);
+        }
+    };
+
+    static const Table& Tables() {
+        static const Table table;
+        return table;
+    }
+};
+
+#endif
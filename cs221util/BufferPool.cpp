@@ -0,0 +1,163 @@
+/**
+ * @file BufferPool.cpp
+ * Implementation of the BufferPool, and the lodepng allocation hooks that
+ * route lodepng's memory through it. lodepng must be compiled with
+ * LODEPNG_NO_COMPILE_ALLOCATORS for the hooks to be used.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "BufferPool.h"
+
+namespace cs221util {
+  namespace {
+    /**
+     * Every block starts with its capacity, padded so that the caller's
+     * pointer keeps malloc's 16-byte alignment.
+     */
+    struct Header {
+      std::size_t capacity;
+      std::size_t padding;
+    };
+
+    struct Pool {
+      std::mutex lock;
+      std::unordered_map<std::size_t, std::vector<Header *>> freeLists;
+      std::size_t limit = 256u << 20;
+      BufferPool::Stats stats = BufferPool::Stats();
+    };
+
+    // never destroyed, so blocks freed by static destructors are still safe
+    Pool & pool() {
+      static Pool * instance = new Pool();
+      return *instance;
+    }
+
+    /**
+     * Rounds size up to its class: multiples of 64 bytes up to 128, then
+     * four evenly spaced classes between consecutive powers of two.
+     */
+    std::size_t classSize(std::size_t size) {
+      if (size <= 128) {
+        return (size + 63) / 64 * 64 + (size == 0 ? 64 : 0);
+      }
+      std::size_t n = size - 1;
+      int bit = 0;
+      while ((n >> bit) > 1) {
+        bit++;
+      }
+      std::size_t step = (std::size_t) 1 << (bit - 2);
+      return (n / step + 1) * step;
+    }
+
+    Header * header(void * ptr) {
+      return (Header *) ptr - 1;
+    }
+  }
+
+  void * BufferPool::allocate(std::size_t size) {
+    std::size_t capacity = classSize(size);
+    Pool & p = pool();
+    {
+      std::lock_guard<std::mutex> guard(p.lock);
+      p.stats.allocations++;
+      auto found = p.freeLists.find(capacity);
+      if (found != p.freeLists.end() && !found->second.empty()) {
+        Header * block = found->second.back();
+        found->second.pop_back();
+        p.stats.cachedBytes -= capacity;
+        p.stats.cachedBlocks--;
+        return block + 1;
+      }
+      p.stats.systemAllocations++;
+    }
+    Header * block = (Header *) std::malloc(sizeof(Header) + capacity);
+    if (block == NULL) {
+      return NULL;
+    }
+    block->capacity = capacity;
+    return block + 1;
+  }
+
+  void * BufferPool::reallocate(void * ptr, std::size_t size) {
+    if (ptr == NULL) {
+      return allocate(size);
+    }
+    std::size_t capacity = header(ptr)->capacity;
+    if (size <= capacity) {
+      return ptr;
+    }
+    void * moved = allocate(size);
+    if (moved == NULL) {
+      return NULL;
+    }
+    std::memcpy(moved, ptr, capacity);
+    release(ptr);
+    return moved;
+  }
+
+  void BufferPool::release(void * ptr) {
+    if (ptr == NULL) {
+      return;
+    }
+    Header * block = header(ptr);
+    Pool & p = pool();
+    {
+      std::lock_guard<std::mutex> guard(p.lock);
+      if (p.stats.cachedBytes + block->capacity <= p.limit) {
+        p.freeLists[block->capacity].push_back(block);
+        p.stats.cachedBytes += block->capacity;
+        p.stats.cachedBlocks++;
+        return;
+      }
+    }
+    std::free(block);
+  }
+
+  void BufferPool::setLimit(std::size_t bytes) {
+    Pool & p = pool();
+    std::lock_guard<std::mutex> guard(p.lock);
+    p.limit = bytes;
+  }
+
+  void BufferPool::trim() {
+    Pool & p = pool();
+    std::unordered_map<std::size_t, std::vector<Header *>> blocks;
+    {
+      std::lock_guard<std::mutex> guard(p.lock);
+      blocks.swap(p.freeLists);
+      p.stats.cachedBytes = 0;
+      p.stats.cachedBlocks = 0;
+    }
+    for (auto & entry : blocks) {
+      for (Header * block : entry.second) {
+        std::free(block);
+      }
+    }
+  }
+
+  BufferPool::Stats BufferPool::stats() {
+    Pool & p = pool();
+    std::lock_guard<std::mutex> guard(p.lock);
+    return p.stats;
+  }
+}
+
+/*
+ * Allocation hooks declared by lodepng.cpp when it is compiled without its
+ * own allocators.
+ */
+void* lodepng_malloc(size_t size) {
+  return cs221util::BufferPool::allocate(size);
+}
+
+void* lodepng_realloc(void* ptr, size_t new_size) {
+  return cs221util::BufferPool::reallocate(ptr, new_size);
+}
+
+void lodepng_free(void* ptr) {
+  cs221util::BufferPool::release(ptr);
+}
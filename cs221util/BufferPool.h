@@ -0,0 +1,77 @@
+/**
+ * @file BufferPool.h
+ * Process-wide cache of freed memory blocks. PNG pixel arrays and every
+ * lodepng allocation (file buffers, zlib windows and hash tables, decoded
+ * and encoded bytes) come from here, so a long-running process that keeps
+ * handling images of the same sizes stops allocating from the system once
+ * the first few images have been through.
+ */
+
+#ifndef CS221_BUFFERPOOL_H_
+#define CS221_BUFFERPOOL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace cs221util {
+  /**
+   * Size-class allocator with a cache of freed blocks. Requests are
+   * rounded up to one of four classes per power of two, so a block wastes
+   * at most a quarter of its size, and freed blocks are kept per class for
+   * the next request of that class until the cache reaches its limit.
+   * Every function is thread-safe.
+   */
+  class BufferPool {
+  public:
+    /**
+     * Counters describing the pool's use since the process started.
+     */
+    struct Stats {
+      uint64_t allocations;       /*< Blocks handed out */
+      uint64_t systemAllocations; /*< Blocks that had to come from malloc */
+      uint64_t cachedBytes;       /*< Bytes held in freed blocks right now */
+      uint64_t cachedBlocks;      /*< Freed blocks held right now */
+    };
+
+    /**
+     * Returns a block of at least size bytes, aligned like malloc's.
+     * @return nullptr, if the system is out of memory.
+     */
+    static void * allocate(std::size_t size);
+
+    /**
+     * Resizes a block returned by allocate, moving it only if its size
+     * class is too small. A null ptr behaves like allocate.
+     */
+    static void * reallocate(void * ptr, std::size_t size);
+
+    /**
+     * Returns a block to the pool. A null ptr is ignored.
+     */
+    static void release(void * ptr);
+
+    /**
+     * Sets the most bytes of freed blocks kept for reuse; blocks freed
+     * beyond it go back to the system. The default is 256 MB. The pool
+     * stops saving allocations once the blocks a process frees and
+     * requests again no longer fit under the limit: a block larger than
+     * the limit is never kept, so the pixels of a 100-megapixel image
+     * (400 MB) come from the system every time. Processes handling images
+     * that large should raise the limit to the memory they are prepared
+     * to hold; batch gives it a quarter of its --mem budget.
+     */
+    static void setLimit(std::size_t bytes);
+
+    /**
+     * Frees every cached block.
+     */
+    static void trim();
+
+    /**
+     * Returns a snapshot of the pool's counters.
+     */
+    static Stats stats();
+  };
+}
+
+#endif
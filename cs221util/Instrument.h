@@ -0,0 +1,88 @@
+/**
+ * @file Instrument.h
+ * Compile-time removable instrumentation shared by the PNG class and the
+ * TripleTree. Counters are only maintained when TRIPLETREE_STATS is
+ * defined; otherwise INSTRUMENT expands to nothing and every counter reads
+ * as zero.
+ */
+
+#ifndef CS221_INSTRUMENT_H_
+#define CS221_INSTRUMENT_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#ifdef TRIPLETREE_STATS
+#define INSTRUMENT(stmt) do { stmt; } while (0)
+#define INSTRUMENT_TIMER(name, seconds) cs221util::ScopedTimer name(seconds)
+#define INSTRUMENT_SHARED_TIMER(name, nanoseconds) cs221util::ScopedSharedTimer name(nanoseconds)
+#else
+#define INSTRUMENT(stmt) do { } while (0)
+#define INSTRUMENT_TIMER(name, seconds) (void) (seconds)
+#define INSTRUMENT_SHARED_TIMER(name, nanoseconds) (void) (nanoseconds)
+#endif
+
+namespace cs221util {
+  /**
+   * Process-wide PNG encode/decode counters.
+   */
+  struct IOStats {
+    uint64_t decodes;        /*< Number of images decoded */
+    uint64_t encodes;        /*< Number of images encoded */
+    uint64_t bytesRead;      /*< Compressed bytes consumed by decodes */
+    uint64_t bytesInflated;  /*< Raw RGBA bytes produced by decodes */
+    uint64_t bytesDeflated;  /*< Compressed bytes produced by encodes */
+    double decodeSeconds;    /*< Wall time spent decoding */
+    double encodeSeconds;    /*< Wall time spent encoding */
+  };
+
+  /**
+   * Returns a snapshot of the PNG counters.
+   */
+  IOStats ioStats();
+
+  /**
+   * Sets every PNG counter back to zero.
+   */
+  void resetIOStats();
+
+  /**
+   * Adds the wall time between its construction and destruction to a
+   * counter, in seconds.
+   */
+  class ScopedTimer {
+  public:
+    explicit ScopedTimer(double & seconds)
+      : seconds_(seconds), start_(std::chrono::steady_clock::now()) { }
+
+    ~ScopedTimer() {
+      seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+  private:
+    double & seconds_;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  /**
+   * ScopedTimer for a counter that several threads may add to at once, in
+   * nanoseconds.
+   */
+  class ScopedSharedTimer {
+  public:
+    explicit ScopedSharedTimer(std::atomic<uint64_t> & nanoseconds)
+      : nanoseconds_(nanoseconds), start_(std::chrono::steady_clock::now()) { }
+
+    ~ScopedSharedTimer() {
+      nanoseconds_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_).count(), std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint64_t> & nanoseconds_;
+    std::chrono::steady_clock::time_point start_;
+  };
+}
+
+#endif
@@ -11,20 +11,60 @@
 #include <algorithm>
 #include <functional>
 #include <cassert>
+#include <mutex>
+#include <new>
 #include "lodepng/lodepng.h"
+#include "BufferPool.h"
 #include "PNG.h"
+#include "Instrument.h"
 //#include "RGB_HSL.h"
 
 namespace cs221util {
+  static IOStats ioStats_ = IOStats();
+  static std::mutex ioStatsLock_;
+
+  IOStats ioStats() {
+    std::lock_guard<std::mutex> guard(ioStatsLock_);
+    return ioStats_;
+  }
+
+  void resetIOStats() {
+    std::lock_guard<std::mutex> guard(ioStatsLock_);
+    ioStats_ = IOStats();
+  }
+
+  /**
+   * Pixel arrays come from the BufferPool, so images of a size the process
+   * has seen before reuse an earlier image's memory.
+   */
+  static RGBAPixel * allocatePixels(std::size_t count) {
+    void * memory = BufferPool::allocate(sizeof(RGBAPixel) * count);
+    if (memory == NULL) {
+      throw std::bad_alloc();
+    }
+    RGBAPixel * pixels = static_cast<RGBAPixel *>(memory);
+    for (std::size_t i = 0; i < count; i++) {
+      new (&pixels[i]) RGBAPixel();
+    }
+    return pixels;
+  }
+
+  // RGBAPixel is trivially destructible, so its memory can go straight back
+  static void releasePixels(RGBAPixel * pixels) {
+    BufferPool::release(pixels);
+  }
+
   void PNG::_copy(PNG const & other) {
-    // Clear self
-    delete[] imageData_;
+    // Clear self, keeping the pixel array if it already has the right size
+    if (imageData_ == NULL || (std::size_t) width_ * height_ != (std::size_t) other.width_ * other.height_) {
+      releasePixels(imageData_);
+      imageData_ = allocatePixels((std::size_t) other.width_ * other.height_);
+    }
 
     // Copy `other` to self
     width_ = other.width_;
     height_ = other.height_;
-    imageData_ = new RGBAPixel[width_ * height_];
-    for (unsigned i = 0; i < width_ * height_; i++) {
+    for (std::size_t i = 0; i < (std::size_t) width_ * height_; i++) {
       imageData_[i] = other.imageData_[i];
     }
   }
@@ -38,7 +78,7 @@ namespace cs221util {
   PNG::PNG(unsigned int width, unsigned int height) {
     width_ = width;
     height_ = height;
-    imageData_ = new RGBAPixel[width * height];
+    imageData_ = allocatePixels((std::size_t) width * height);
   }
 
   PNG::PNG(PNG const & other) {
@@ -47,7 +87,7 @@ namespace cs221util {
   }
 
   PNG::~PNG() {
-    delete[] imageData_;
+    releasePixels(imageData_);
   }
 
   PNG const & PNG::operator=(PNG const & other) {
@@ -55,11 +95,39 @@ namespace cs221util {
     return *this;
   }
 
+  PNG::PNG(PNG && other) noexcept {
+    width_ = other.width_;
+    height_ = other.height_;
+    imageData_ = other.imageData_;
+    other.width_ = 0;
+    other.height_ = 0;
+    other.imageData_ = NULL;
+  }
+
+  PNG const & PNG::operator=(PNG && other) noexcept {
+    if (this != &other) {
+      releasePixels(imageData_);
+      width_ = other.width_;
+      height_ = other.height_;
+      imageData_ = other.imageData_;
+      other.width_ = 0;
+      other.height_ = 0;
+      other.imageData_ = NULL;
+    }
+    return *this;
+  }
+
+  void PNG::swap(PNG & other) noexcept {
+    std::swap(width_, other.width_);
+    std::swap(height_, other.height_);
+    std::swap(imageData_, other.imageData_);
+  }
+
   bool PNG::operator==(PNG const & other) const {
     if (width_ != other.width_) { return false; }
     if (height_ != other.height_) { return false; }
 
-    for (unsigned i = 0; i < width_ * height_; i++) {
+    for (std::size_t i = 0; i < (std::size_t) width_ * height_; i++) {
       RGBAPixel & p1 = imageData_[i];
       RGBAPixel & p2 = other.imageData_[i];
       if (p1 != p2) { return false; }
@@ -93,23 +161,60 @@ namespace cs221util {
       y = height_ - 1;
     }
 
-    unsigned index = x + (y * width_);
+    std::size_t index = x + ((std::size_t) y * width_);
     return &imageData_[index];
   }
 
   bool PNG::readFromFile(string const & fileName) {
-    vector<unsigned char> byteData;
-    unsigned error = lodepng::decode(byteData, width_, height_, fileName);
+    // lodepng's C interface allocates through the BufferPool hooks, where
+    // its C++ wrappers would copy everything into std::vectors
+    unsigned char *fileData = NULL;
+    size_t fileSize = 0;
+    unsigned error = lodepng_load_file(&fileData, &fileSize, fileName.c_str());
+    if (error) {
+      BufferPool::release(fileData);
+      cerr << "PNG decoder error " << error << ": " << lodepng_error_text(error) << endl;
+      return false;
+    }
+
+    bool decoded = decode(fileData, fileSize);
+    BufferPool::release(fileData);
+    return decoded;
+  }
+
+  bool PNG::decode(const unsigned char * data, size_t size) {
+    unsigned char *byteData = NULL;
+    unsigned width = 0, height = 0;
+    double seconds = 0;
+    unsigned error;
+    {
+      INSTRUMENT_TIMER(timer, seconds);
+      error = lodepng_decode32(&byteData, &width, &height, data, size);
+    }
+    size_t byteSize = error ? 0 : (size_t) width * height * 4;
+    INSTRUMENT({
+      std::lock_guard<std::mutex> guard(ioStatsLock_);
+      ioStats_.decodes++;
+      ioStats_.bytesRead += size;
+      ioStats_.bytesInflated += byteSize;
+      ioStats_.decodeSeconds += seconds;
+    });
 
     if (error) {
+      BufferPool::release(byteData);
       cerr << "PNG decoder error " << error << ": " << lodepng_error_text(error) << endl;
       return false;
     }
 
-    delete[] imageData_;
-    imageData_ = new RGBAPixel[width_ * height_];
+    // keep the current pixel array if it already has the right size
+    if (imageData_ == NULL || (std::size_t) width * height != (std::size_t) width_ * height_) {
+      releasePixels(imageData_);
+      imageData_ = allocatePixels((std::size_t) width * height);
+    }
+    width_ = width;
+    height_ = height;
 
-    for (unsigned i = 0; i < byteData.size(); i += 4) {
+    for (std::size_t i = 0; i < byteSize; i += 4) {
       RGBAPixel & pixel = imageData_[i/4];
       pixel.r = byteData[i];
       pixel.g = byteData[i + 1];
@@ -117,6 +222,7 @@ namespace cs221util {
       pixel.a = byteData[i + 3]/255.;
 
     }
+    BufferPool::release(byteData);
 /*
     for (unsigned i = 0; i < byteData.size(); i += 4) {
       rgbaColor rgb;
@@ -137,8 +243,18 @@ namespace cs221util {
     return true;
   }
 
-  bool PNG::writeToFile(string const & fileName) {
-    unsigned char *byteData = new unsigned char[width_ * height_ * 4];
+  bool PNG::decode(vector<unsigned char> const & data) {
+    return decode(data.data(), data.size());
+  }
+
+  unsigned PNG::_encode(unsigned char ** out, size_t * outSize) const {
+    *out = NULL;
+    *outSize = 0;
+    unsigned char *byteData =
+        static_cast<unsigned char *>(BufferPool::allocate((size_t) width_ * height_ * 4));
+    if (byteData == NULL) {
+      return 83; // lodepng's code for a failed allocation
+    }
 /*
     for (unsigned i = 0; i < width_ * height_; i++) {
       hslaColor hsl;
@@ -155,22 +271,59 @@ namespace cs221util {
       byteData[(i * 4) + 3] = rgb.a;
     }*/
 
-    for (unsigned i = 0; i < width_ * height_; i++) {
+    for (std::size_t i = 0; i < (std::size_t) width_ * height_; i++) {
       byteData[(i * 4)]     = imageData_[i].r;
       byteData[(i * 4) + 1] = imageData_[i].g;
       byteData[(i * 4) + 2] = imageData_[i].b;
       byteData[(i * 4) + 3] = imageData_[i].a * 255;
     }
 
-    unsigned error = lodepng::encode(fileName, byteData, width_, height_);
+    double seconds = 0;
+    unsigned error;
+    {
+      INSTRUMENT_TIMER(timer, seconds);
+      error = lodepng_encode32(out, outSize, byteData, width_, height_);
+    }
+    BufferPool::release(byteData);
+    INSTRUMENT({
+      std::lock_guard<std::mutex> guard(ioStatsLock_);
+      ioStats_.encodes++;
+      ioStats_.bytesDeflated += *outSize;
+      ioStats_.encodeSeconds += seconds;
+    });
+    return error;
+  }
+
+  bool PNG::writeToFile(string const & fileName) {
+    unsigned char *fileData = NULL;
+    size_t fileSize = 0;
+    unsigned error = _encode(&fileData, &fileSize);
+    if (!error) {
+      error = lodepng_save_file(fileData, fileSize, fileName.c_str());
+    }
     if (error) {
       cerr << "PNG encoding error " << error << ": " << lodepng_error_text(error) << endl;
     }
 
-    delete[] byteData;
+    BufferPool::release(fileData);
     return (error == 0);
   }
 
+  vector<unsigned char> PNG::encode() const {
+    unsigned char *fileData = NULL;
+    size_t fileSize = 0;
+    unsigned error = _encode(&fileData, &fileSize);
+    vector<unsigned char> encoded;
+    if (error) {
+      cerr << "PNG encoding error " << error << ": " << lodepng_error_text(error) << endl;
+    } else {
+      encoded.assign(fileData, fileData + fileSize);
+    }
+
+    BufferPool::release(fileData);
+    return encoded;
+  }
+
   unsigned int PNG::width() const {
     return width_;
   }
@@ -181,7 +334,7 @@ namespace cs221util {
 
   void PNG::resize(unsigned int newWidth, unsigned int newHeight) {
     // Create a new vector to store the image data for the new (resized) image
-    RGBAPixel * newImageData = new RGBAPixel[newWidth * newHeight];
+    RGBAPixel * newImageData = allocatePixels((std::size_t) newWidth * newHeight);
 
     // Copy the current data to the new image data, using the existing pixel
     // for coordinates within the bounds of the old image size
@@ -189,14 +342,14 @@ namespace cs221util {
       for (unsigned y = 0; y < newHeight; y++) {
         if (x < width_ && y < height_) {
           RGBAPixel * oldPixel = this->getPixel(x, y);
-          RGBAPixel & newPixel = newImageData[ (x + (y * newWidth)) ];
+          RGBAPixel & newPixel = newImageData[ (x + ((std::size_t) y * newWidth)) ];
           newPixel = *oldPixel;
         }
       }
     }
 
     // Clear the existing image
-    delete[] imageData_;
+    releasePixels(imageData_);
 
     // Update the image to reflect the new image size and data
     width_ = newWidth;
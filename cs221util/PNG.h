@@ -50,6 +50,27 @@ namespace cs221util {
       */
     PNG const & operator= (PNG const & other);
 
+    /**
+      * Move constructor: takes over the pixel data of another image
+      * without copying it. other is left as an empty 0x0 image.
+      * @param other PNG to be moved from.
+      */
+    PNG(PNG && other) noexcept;
+
+    /**
+      * Move assignment: frees the current pixels and takes over those
+      * of other without copying them. other is left as an empty image.
+      * @param other Image to move into the current image.
+      * @return The current image for assignment chaining.
+      */
+    PNG const & operator= (PNG && other) noexcept;
+
+    /**
+      * Exchanges the contents of two images in constant time.
+      * @param other Image to swap with.
+      */
+    void swap(PNG & other) noexcept;
+
     /**
       * Equality operator: checks if two images are the same.
       * @param other Image to be checked.
@@ -80,6 +101,29 @@ namespace cs221util {
       */
     bool writeToFile(string const & fileName);
 
+    /**
+      * Decodes a PNG image from encoded bytes in memory, as read from a
+      * file or received over a network. Overwrites any current image
+      * content in the PNG.
+      * @param data First byte of the encoded image.
+      * @param size Number of encoded bytes.
+      * @return true, if the image was successfully decoded and loaded.
+      */
+    bool decode(const unsigned char * data, size_t size);
+
+    /**
+      * Decodes a PNG image from a buffer of encoded bytes.
+      * @param data Encoded image.
+      * @return true, if the image was successfully decoded and loaded.
+      */
+    bool decode(vector<unsigned char> const & data);
+
+    /**
+      * Encodes the image as PNG file bytes in memory.
+      * @return The encoded image, or an empty vector if encoding failed.
+      */
+    vector<unsigned char> encode() const;
+
     /**
       * Pixel access operator. Gets a pointer to the pixel at the given
       * coordinates in the image. (0,0) is the upper left corner.
@@ -126,8 +170,20 @@ namespace cs221util {
      * Copeies the contents of `other` to self
      */
      void _copy(PNG const & other);
+
+    /**
+     * Encodes self into a BufferPool block, which the caller releases.
+     * @return lodepng's error code, 0 on success.
+     */
+     unsigned _encode(unsigned char ** out, size_t * outSize) const;
   };
 
+  /**
+    * Exchanges two images in constant time, found by argument-dependent
+    * lookup from generic code.
+    */
+  inline void swap(PNG & a, PNG & b) noexcept { a.swap(b); }
+
   std::ostream & operator<<(std::ostream & out, PNG const & pixel);
   std::stringstream & operator<<(std::stringstream & out, PNG const & pixel);
 }
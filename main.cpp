@@ -10,10 +10,20 @@
 #define IMAGE_5 "pruneto16leaves-8x5"
 #define IMAGE_6 "malachi-60x87"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <sstream>
 #include <string>
+#include <thread>
 
 #include "tripletree.h"
+#include "mappedtree.h"
+#include "sharedtree.h"
+#include "tiledforest.h"
+#include "cs221util/BufferPool.h"
 
 using namespace std;
 
@@ -24,6 +34,28 @@ void TestBuildRender(int image_num);
 void TestFlipHorizontal(int image_num);
 void TestRotateCCW(int image_num);
 void TestPrune(int image_num, double tol);
+void TestMappedRender(int image_num, double tol);
+void TestProgressiveRender(int image_num);
+void TestRenderRegion(int image_num);
+void TestRenderScaled(int image_num);
+void TestColorQueries(int image_num);
+void TestMoveSwap(int image_num);
+void TestBufferPool(int image_num);
+void TestMemoryCodec(int image_num);
+void TestColorMetrics(int image_num);
+void TestPruneByVariance(int image_num, double tol);
+void TestIncrementalPrune(int image_num);
+void TestPruneToQuality(int image_num, double psnr);
+void TestFusedPrune(int image_num, double tol);
+void TestSummedAreaTable(int image_num, double tol);
+void TestLazyExpansion(int image_num, double tol);
+void TestNodeBudget(int image_num);
+void TestSharedTree(int image_num);
+void TestTiledForest(int image_num, unsigned int tileSize, double tol);
+string ImageName(int image_num);
+double MeasurePSNR(const PNG& image, const PNG& render);
+unsigned long CropMismatches(const PNG& region, const PNG& full, unsigned int x, unsigned int y);
+unsigned long BoxMismatches(const PNG& scaled, const PNG& full);
 
 
 /***********************************/
@@ -47,6 +79,24 @@ int main(int argc, char* argv[]) {
 	TestFlipHorizontal(image_number);
 	TestRotateCCW(image_number);
 	TestPrune(image_number, 0.1);
+	TestMappedRender(image_number, 0.1);
+	TestProgressiveRender(image_number);
+	TestRenderRegion(image_number);
+	TestRenderScaled(image_number);
+	TestColorQueries(image_number);
+	TestMoveSwap(image_number);
+	TestBufferPool(image_number);
+	TestMemoryCodec(image_number);
+	TestColorMetrics(image_number);
+	TestPruneByVariance(image_number, 0.002);
+	TestIncrementalPrune(image_number);
+	TestPruneToQuality(image_number, 30);
+	TestFusedPrune(image_number, 0.1);
+	TestSummedAreaTable(image_number, 0.002);
+	TestLazyExpansion(image_number, 0.002);
+	TestNodeBudget(image_number);
+	TestSharedTree(image_number);
+	TestTiledForest(image_number, 16, 0.1);
 
 	return 0;
 }
@@ -341,4 +391,998 @@ void TestPrune(int image_num, double tol) {
 	cout << "done." << endl;
 
 	cout << "Exiting TestPrune.\n" << endl;
-}
\ No newline at end of file
+}
+
+void TestMappedRender(int image_num, double tol) {
+	cout << "Entered TestMappedRender, tolerance: " << tol << endl;
+
+	// read input PNG
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	string output_path = "images-output/" + ImageName(image_num);
+	PNG input;
+	input.readFromFile(input_path);
+
+	cout << "Constructing and pruning TripleTree from image... ";
+	TripleTree t(input);
+	t.Prune(tol);
+	cout << "done." << endl;
+
+	cout << "Writing flat tree to file... ";
+	t.WriteToFile(output_path + "-prune.ttree");
+	cout << "done." << endl;
+
+	cout << "Mapping flat tree from file... ";
+	MappedTripleTree m;
+	m.Open(output_path + "-prune.ttree");
+	cout << "done." << endl;
+
+	cout << "Mapped tree contains " << m.NumLeaves() << " leaves, pointer tree contains "
+		<< t.NumLeaves() << " leaves." << endl;
+
+	cout << "Rendering mapped tree to PNG... ";
+	PNG output = m.Render();
+	cout << "done." << endl;
+
+	cout << "Mapped render " << (output == t.Render() ? "matches" : "DIFFERS FROM") << " pointer render." << endl;
+
+	// a crafted stream in which node i claims nodes i + 1 and i + 2 as its
+	// children: followed blindly, the walk would visit a Fibonacci number
+	// of paths, but the claimed children lie outside their claimants
+	stringstream stream;
+	TripleTree(input).Write(stream);
+	string bytes = stream.str();
+	uint64_t count = (bytes.size() - sizeof(FlatHeader)) / sizeof(FlatNode);
+	for (uint64_t i = 1; i + 2 < count; i++) {
+		FlatNode n;
+		char *at = &bytes[sizeof(FlatHeader) + i * sizeof(FlatNode)];
+		memcpy(&n, at, sizeof(FlatNode));
+		n.firstChild = i + 1;
+		n.numChildren = 2;
+		memcpy(at, &n, sizeof(FlatNode));
+	}
+	MappedTripleTree crafted;
+	crafted.Attach(bytes.data(), bytes.size());
+	PNG region = crafted.RenderRegion(0, 0, input.width(), input.height());
+	cout << "RenderRegion of a stream with overlapping children " << (region == crafted.Render(1) ? "stops" : "DOES NOT STOP")
+		<< " below the root's children." << endl;
+
+	// write output PNG
+	cout << "Writing rendered PNG to file... ";
+	output.writeToFile(output_path + "-mapped-render.png");
+	cout << "done." << endl;
+
+	cout << "Exiting TestMappedRender.\n" << endl;
+}
+
+void TestProgressiveRender(int image_num) {
+	cout << "Entered TestProgressiveRender" << endl;
+
+	// read input PNG
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	string output_path = "images-output/" + ImageName(image_num);
+	PNG input;
+	input.readFromFile(input_path);
+
+	cout << "Constructing TripleTree from image... ";
+	TripleTree t(input);
+	cout << "done." << endl;
+
+	cout << "Rendering tree progressively... ";
+	int levels = 0;
+	PNG last;
+	t.RenderProgressive([&](int depth, const PNG& canvas) {
+		levels = depth + 1;
+		last = canvas;
+	});
+	cout << "done, " << levels << " levels." << endl;
+
+	cout << "Final level " << (last == t.Render() ? "matches" : "DIFFERS FROM") << " full render." << endl;
+
+	cout << "Rendering tree to depth 2... ";
+	PNG output = t.Render(2);
+	cout << "done." << endl;
+
+	// write output PNG
+	cout << "Writing rendered PNG to file... ";
+	output.writeToFile(output_path + "-depth2-render.png");
+	cout << "done." << endl;
+
+	cout << "Rendering first half of the serialized stream... ";
+	stringstream stream;
+	t.Write(stream);
+	string bytes = stream.str();
+	MappedTripleTree m;
+	m.Attach(bytes.data(), sizeof(FlatHeader) + (bytes.size() - sizeof(FlatHeader)) / 2);
+	output = m.Render();
+	cout << "done." << endl;
+
+	// write output PNG
+	cout << "Writing rendered PNG to file... ";
+	output.writeToFile(output_path + "-prefix-render.png");
+	cout << "done." << endl;
+
+	// damage the last node, a leaf, so that it claims children before it
+	FlatNode tail;
+	char *lastBytes = &bytes[bytes.size() - sizeof(FlatNode)];
+	memcpy(&tail, lastBytes, sizeof(FlatNode));
+	tail.numChildren = 2;
+	tail.firstChild = 0;
+	memcpy(lastBytes, &tail, sizeof(FlatNode));
+	m.Attach(bytes.data(), bytes.size());
+	PNG damaged = m.Render();
+	bool agree = damaged == m.Render(numeric_limits<int>::max())
+		&& damaged == m.RenderRegion(0, 0, damaged.width(), damaged.height());
+	cout << "Renders of a damaged stream " << (agree ? "agree" : "DISAGREE") << "." << endl;
+
+	cout << "Exiting TestProgressiveRender.\n" << endl;
+}
+
+/**
+ * Counts the pixels of a viewport-sized render that differ from the crop
+ * of a full render at (x, y). Pixels outside the full render must keep
+ * the color of a new PNG.
+ */
+unsigned long CropMismatches(const PNG& region, const PNG& full, unsigned int x, unsigned int y) {
+	PNG blank(1, 1);
+	unsigned long mismatches = 0;
+	for (unsigned int py = 0; py < region.height(); py++) {
+		for (unsigned int px = 0; px < region.width(); px++) {
+			unsigned long fx = (unsigned long) x + px, fy = (unsigned long) y + py;
+			bool inside = fx < full.width() && fy < full.height();
+			RGBAPixel expected = inside ? *full.getPixel(fx, fy) : *blank.getPixel(0, 0);
+			if (*region.getPixel(px, py) != expected) {
+				mismatches++;
+			}
+		}
+	}
+	return mismatches;
+}
+
+void TestRenderRegion(int image_num) {
+	cout << "Entered TestRenderRegion" << endl;
+
+	// read input PNG
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	string output_path = "images-output/" + ImageName(image_num);
+	PNG input;
+	input.readFromFile(input_path);
+
+	cout << "Constructing TripleTree from image... ";
+	TripleTree t(input);
+	cout << "done." << endl;
+
+	// the lower-right quarter of the image, at least one pixel
+	unsigned int w = (input.width() + 1) / 2;
+	unsigned int h = (input.height() + 1) / 2;
+	unsigned int x = input.width() - w;
+	unsigned int y = input.height() - h;
+
+	cout << "Rendering region " << w << "x" << h << " at (" << x << ", " << y << ")... ";
+	PNG output = t.RenderRegion(x, y, w, h);
+	cout << "done." << endl;
+
+	// write output PNG
+	cout << "Writing rendered PNG to file... ";
+	output.writeToFile(output_path + "-region-render.png");
+	cout << "done." << endl;
+
+	// regions inside the image, clipped by its right and bottom edges, and
+	// outside it, on the full tree and on a pruned copy
+	unsigned int iw = input.width(), ih = input.height();
+	unsigned int regions[][4] = {
+		{ x, y, w, h }, { 0, 0, iw, ih }, { iw / 2, ih / 3, iw, ih }, { iw - 1, 0, 3, ih + 2 },
+		{ 0, ih - 1, iw + 5, 1 }, { iw, ih, 2, 2 }
+	};
+	TripleTree pruned(t);
+	pruned.Prune(0.05);
+	unsigned long mismatches = 0;
+	for (const TripleTree* tree : { &t, &pruned }) {
+		PNG full = tree->Render();
+		for (const auto& r : regions) {
+			mismatches += CropMismatches(tree->RenderRegion(r[0], r[1], r[2], r[3]), full, r[0], r[1]);
+		}
+	}
+	cout << "RenderRegion differs from the crop of Render() at " << mismatches << " pixels." << endl;
+
+	cout << "Exiting TestRenderRegion.\n" << endl;
+}
+
+/**
+ * Counts the pixels of a downscaled render that differ by more than one
+ * level, or alpha by more than 1/255, from the area-weighted average of
+ * the full render's pixels they cover. Node averages are rounded, so the
+ * tree's own averages may be a level off the exact ones.
+ */
+unsigned long BoxMismatches(const PNG& scaled, const PNG& full) {
+	unsigned int outW = scaled.width(), outH = scaled.height();
+	double sx = (double) outW / full.width(), sy = (double) outH / full.height();
+	// per output pixel: weighted sums of r, g, b, a and the total weight
+	vector<double> acc((size_t) outW * outH * 5, 0.0);
+	for (unsigned int y = 0; y < full.height(); y++) {
+		for (unsigned int x = 0; x < full.width(); x++) {
+			RGBAPixel* p = full.getPixel(x, y);
+			for (unsigned int oy = (unsigned int) (y * sy); oy < outH && oy < (y + 1) * sy; oy++) {
+				double wy = min((y + 1) * sy, oy + 1.0) - max(y * sy, (double) oy);
+				for (unsigned int ox = (unsigned int) (x * sx); ox < outW && ox < (x + 1) * sx; ox++) {
+					double weight = wy * (min((x + 1) * sx, ox + 1.0) - max(x * sx, (double) ox));
+					double* q = &acc[((size_t) oy * outW + ox) * 5];
+					q[0] += weight * p->r;
+					q[1] += weight * p->g;
+					q[2] += weight * p->b;
+					q[3] += weight * p->a;
+					q[4] += weight;
+				}
+			}
+		}
+	}
+	unsigned long mismatches = 0;
+	for (unsigned int oy = 0; oy < outH; oy++) {
+		for (unsigned int ox = 0; ox < outW; ox++) {
+			double* q = &acc[((size_t) oy * outW + ox) * 5];
+			RGBAPixel* p = scaled.getPixel(ox, oy);
+			if (fabs(p->r - q[0] / q[4]) > 1.5 || fabs(p->g - q[1] / q[4]) > 1.5 || fabs(p->b - q[2] / q[4]) > 1.5
+					|| fabs(p->a - q[3] / q[4]) > 1.0 / 255) {
+				mismatches++;
+			}
+		}
+	}
+	return mismatches;
+}
+
+void TestRenderScaled(int image_num) {
+	cout << "Entered TestRenderScaled" << endl;
+
+	// read input PNG
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	string output_path = "images-output/" + ImageName(image_num);
+	PNG input;
+	input.readFromFile(input_path);
+
+	cout << "Constructing TripleTree from image... ";
+	TripleTree t(input);
+	cout << "done." << endl;
+
+	// a third of each dimension, at least one pixel
+	unsigned int w = (input.width() + 2) / 3;
+	unsigned int h = (input.height() + 2) / 3;
+
+	cout << "Rendering tree at " << w << "x" << h << "... ";
+	PNG output = t.Render(w, h);
+	cout << "done." << endl;
+
+	// write output PNG
+	cout << "Writing rendered PNG to file... ";
+	output.writeToFile(output_path + "-scaled-render.png");
+	cout << "done." << endl;
+
+	PNG full = t.Render();
+	cout << "Render at the tree's own size " << (t.Render(input.width(), input.height()) == full ? "matches" : "DIFFERS FROM")
+		<< " Render()." << endl;
+	unsigned long mismatches = BoxMismatches(t.Render((input.width() + 1) / 2, (input.height() + 1) / 2), full)
+		+ BoxMismatches(output, full);
+	cout << "Halved and third-size renders differ from box averages of Render() at " << mismatches << " pixels." << endl;
+
+	cout << "Exiting TestRenderScaled.\n" << endl;
+}
+
+void TestColorQueries(int image_num) {
+	cout << "Entered TestColorQueries" << endl;
+
+	// read input PNG
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	PNG input;
+	input.readFromFile(input_path);
+
+	cout << "Constructing TripleTree from image... ";
+	TripleTree t(input);
+	cout << "done." << endl;
+
+	cout << "Calling FlipHorizontal and RotateCCW... ";
+	t.FlipHorizontal();
+	t.RotateCCW();
+	cout << "done." << endl;
+
+	PNG output = t.Render();
+	unsigned int mismatches = 0;
+	for (unsigned int y = 0; y < output.height(); y++) {
+		for (unsigned int x = 0; x < output.width(); x++) {
+			if (t.ColorAt(x, y) != *output.getPixel(x, y)) {
+				mismatches++;
+			}
+		}
+	}
+	cout << "ColorAt differs from the render at " << mismatches << " pixels." << endl;
+
+	RGBAPixel whole = t.AverageOver(0, 0, output.width(), output.height());
+	cout << "Average color of the whole image: (" << (int) whole.r << ", " << (int) whole.g
+		<< ", " << (int) whole.b << ", " << whole.a << ")" << endl;
+	RGBAPixel quarter = t.AverageOver(0, 0, (output.width() + 1) / 2, (output.height() + 1) / 2);
+	cout << "Average color of the upper-left quarter: (" << (int) quarter.r << ", " << (int) quarter.g
+		<< ", " << (int) quarter.b << ", " << quarter.a << ")" << endl;
+
+	cout << "Exiting TestColorQueries.\n" << endl;
+}
+
+void TestMoveSwap(int image_num) {
+	cout << "Entered TestMoveSwap" << endl;
+
+	// read input PNG
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	PNG input;
+	input.readFromFile(input_path);
+
+	cout << "Constructing TripleTree from image... ";
+	TripleTree t(input);
+	cout << "done." << endl;
+	PNG expected = t.Render();
+
+	cout << "Moving tree and pruned copy, then swapping... ";
+	TripleTree moved(std::move(t));
+	TripleTree pruned(moved);
+	pruned.Prune(0.1);
+	uint64_t prunedLeaves = pruned.NumLeaves();
+	swap(moved, pruned);
+	t = std::move(pruned);
+	cout << "done." << endl;
+
+	cout << "Moved tree " << (t.Render() == expected ? "matches" : "DIFFERS FROM") << " the original render." << endl;
+	cout << "Swapped tree " << (moved.NumLeaves() == prunedLeaves ? "has" : "DOES NOT HAVE") << " the pruned leaves." << endl;
+
+	PNG image = std::move(expected);
+	cout << "Moved image is " << image.width() << "x" << image.height()
+		<< ", source left " << expected.width() << "x" << expected.height() << "." << endl;
+
+	cout << "Exiting TestMoveSwap.\n" << endl;
+}
+
+/**
+ * Returns the base name of the test image selected by image_num,
+ * falling back to the largest test image.
+ */
+string ImageName(int image_num) {
+	switch (image_num) {
+	case 1:
+		return IMAGE_1;
+	case 2:
+		return IMAGE_2;
+	case 3:
+		return IMAGE_3;
+	case 4:
+		return IMAGE_4;
+	case 5:
+		return IMAGE_5;
+	default:
+		return IMAGE_6;
+	}
+}
+
+void TestBufferPool(int image_num) {
+	cout << "Entered TestBufferPool" << endl;
+
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	string output_path = "images-output/" + ImageName(image_num) + "-pool.png";
+
+	// one round is what a long-running process does per image
+	auto round = [&]() {
+		PNG input;
+		input.readFromFile(input_path);
+		TripleTree t(input);
+		PNG output = t.Render();
+		output.writeToFile(output_path);
+	};
+
+	cout << "Warming up the buffer pool... ";
+	for (int i = 0; i < 2; i++) {
+		round();
+	}
+	cout << "done." << endl;
+
+	BufferPool::Stats before = BufferPool::stats();
+	cout << "Decoding, rendering and encoding 5 more times... ";
+	for (int i = 0; i < 5; i++) {
+		round();
+	}
+	cout << "done." << endl;
+	BufferPool::Stats after = BufferPool::stats();
+
+	cout << "Steady state took " << (after.allocations - before.allocations) << " buffers from the pool and "
+		<< (after.systemAllocations - before.systemAllocations) << " from the system." << endl;
+
+	cout << "Exiting TestBufferPool.\n" << endl;
+}
+
+void TestMemoryCodec(int image_num) {
+	cout << "Entered TestMemoryCodec" << endl;
+
+	// read input PNG
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	PNG input;
+	input.readFromFile(input_path);
+
+	cout << "Encoding image in memory... ";
+	vector<unsigned char> bytes = input.encode();
+	cout << "done, " << bytes.size() << " bytes." << endl;
+
+	PNG decoded;
+	decoded.decode(bytes);
+	cout << "Decoded image " << (decoded == input ? "matches" : "DIFFERS FROM") << " the input." << endl;
+
+	cout << "Constructing TripleTree from encoded bytes... ";
+	TripleTree t(bytes.data(), bytes.size());
+	cout << "done." << endl;
+	TripleTree expected(input);
+	cout << "Tree from bytes " << (t.Render() == expected.Render() ? "matches" : "DIFFERS FROM")
+		<< " the tree from the image." << endl;
+
+	cout << "Constructing TripleTree from truncated bytes... ";
+	TripleTree broken(bytes.data(), bytes.size() / 2);
+	cout << "done, " << broken.NumLeaves() << " leaves." << endl;
+
+	cout << "Exiting TestMemoryCodec.\n" << endl;
+}
+
+/**
+ * Prunes copies of one tree under each metric in colormetric.h, at
+ * tolerances of about the same strictness.
+ */
+template <typename Metric>
+void PruneWithMetric(const TripleTree& t, const string& name, const string& metric, double tol) {
+	TripleTree pruned(t);
+	pruned.Prune<Metric>(tol);
+	cout << "Pruned with " << metric << " at " << tol << ": " << pruned.NumLeaves() << " leaves." << endl;
+	PNG output = pruned.Render();
+	output.writeToFile("images-output/" + name + "-prune-" + metric + ".png");
+}
+
+void TestColorMetrics(int image_num) {
+	cout << "Entered TestColorMetrics" << endl;
+
+	// read input PNG
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	PNG input;
+	input.readFromFile(input_path);
+
+	// the default metric must agree exactly with RGBAPixel::distanceTo
+	int mismatches = 0;
+	for (unsigned int y = 0; y < input.height(); y++) {
+		for (unsigned int x = 0; x < input.width(); x++) {
+			RGBAPixel *p = input.getPixel(x, y);
+			RGBAPixel *q = input.getPixel(input.width() - 1 - x, input.height() - 1 - y);
+			if (RGBADistance::Distance(*p, *q) != p->distanceTo(*q)) {
+				mismatches++;
+			}
+		}
+	}
+	cout << "Default metric " << (mismatches == 0 ? "matches" : "DOES NOT MATCH") << " RGBAPixel::distanceTo." << endl;
+
+	cout << "Constructing TripleTree from image... ";
+	TripleTree t(input);
+	cout << "done, " << t.NumLeaves() << " leaves." << endl;
+
+	PruneWithMetric<RGBADistance>(t, ImageName(image_num), "rgba", 0.1);
+	PruneWithMetric<EuclideanRGB>(t, ImageName(image_num), "euclidean", 0.3);
+	PruneWithMetric<LumaWeightedRGB>(t, ImageName(image_num), "luma", 0.3);
+	PruneWithMetric<CIELab76>(t, ImageName(image_num), "lab", 20);
+
+	cout << "Exiting TestColorMetrics.\n" << endl;
+}
+
+void TestPruneByVariance(int image_num, double tol) {
+	cout << "Entered TestPruneByVariance, tolerance: " << tol << endl;
+
+	// read input PNG
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	PNG input;
+	input.readFromFile(input_path);
+
+	cout << "Constructing TripleTree from image... ";
+	TripleTree t(input);
+	cout << "done, " << t.NumLeaves() << " leaves." << endl;
+
+	cout << "Calling PruneByVariance... ";
+	TripleTree pruned(t);
+	pruned.PruneByVariance(tol);
+	cout << "done." << endl;
+	cout << "Pruned tree contains " << pruned.NumLeaves() << " leaves." << endl;
+
+	cout << "Pruning with tolerance 0 (only flat regions may be pruned)... ";
+	TripleTree exact(t);
+	exact.PruneByVariance(0);
+	cout << "done." << endl;
+	cout << "Render " << (exact.Render() == t.Render() ? "matches" : "DIFFERS FROM") << " the unpruned render." << endl;
+
+	PNG output = pruned.Render();
+	output.writeToFile("images-output/" + ImageName(image_num) + "-prune-variance.png");
+
+	cout << "Exiting TestPruneByVariance.\n" << endl;
+}
+
+void TestIncrementalPrune(int image_num) {
+	cout << "Entered TestIncrementalPrune" << endl;
+
+	// read input PNG
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	PNG input;
+	input.readFromFile(input_path);
+
+	cout << "Constructing TripleTree from image... ";
+	TripleTree t(input);
+	cout << "done, " << t.NumLeaves() << " leaves." << endl;
+
+	TripleTree refined(t);
+	refined.SetIncrementalPrune(true);
+
+	// each step is compared against an ordinary prune of a fresh copy
+	double tols[] = { 0.1, 0.02, 0.3, 0 };
+	for (double tol : tols) {
+		refined.Prune(tol);
+		TripleTree expected(t);
+		expected.Prune(tol);
+		cout << "Refined to tolerance " << tol << ": " << refined.NumLeaves() << " leaves, render "
+			<< (refined.Render() == expected.Render() ? "matches" : "DIFFERS FROM") << " a fresh prune." << endl;
+	}
+
+	refined.PruneByVariance(0.002);
+	TripleTree variance(t);
+	variance.PruneByVariance(0.002);
+	cout << "Switched to PruneByVariance: render "
+		<< (refined.Render() == variance.Render() ? "matches" : "DIFFERS FROM") << " a fresh prune." << endl;
+
+	refined.FlipHorizontal();
+	refined.Prune(0.05);
+	TripleTree flipped(t);
+	flipped.FlipHorizontal();
+	flipped.Prune(0.05);
+	cout << "Flipped and refined to tolerance 0.05: render "
+		<< (refined.Render() == flipped.Render() ? "matches" : "DIFFERS FROM") << " a fresh prune." << endl;
+
+	TripleTree snapshot(refined);
+	refined.Prune(0);
+	cout << "Copy keeps its leaves after the original expands: "
+		<< (snapshot.Render() == flipped.Render() ? "yes" : "NO") << "." << endl;
+
+	refined.SetIncrementalPrune(false);
+	cout << "Unpruned tree " << (t.Render() == input ? "still matches" : "NO LONGER MATCHES") << " the input." << endl;
+
+	cout << "Exiting TestIncrementalPrune.\n" << endl;
+}
+
+/**
+ * PSNR of a render against the image, over RGBA channels in [0, 1], as
+ * TripleTree::PruneToQuality defines it.
+ */
+double MeasurePSNR(const PNG& image, const PNG& render) {
+	double error = 0;
+	for (unsigned int y = 0; y < image.height(); y++) {
+		for (unsigned int x = 0; x < image.width(); x++) {
+			RGBAPixel* p = image.getPixel(x, y);
+			RGBAPixel* q = render.getPixel(x, y);
+			double dr = (p->r - q->r) / 255.0, dg = (p->g - q->g) / 255.0, db = (p->b - q->b) / 255.0;
+			double da = p->a - q->a;
+			error += dr * dr + dg * dg + db * db + da * da;
+		}
+	}
+	double channels = 4.0 * image.width() * image.height();
+	return (error > 0) ? 10 * log10(channels / error) : numeric_limits<double>::infinity();
+}
+
+void TestPruneToQuality(int image_num, double psnr) {
+	cout << "Entered TestPruneToQuality, target PSNR: " << psnr << " dB" << endl;
+
+	// read input PNG
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	PNG input;
+	input.readFromFile(input_path);
+
+	cout << "Constructing TripleTree from image... ";
+	TripleTree t(input);
+	cout << "done, " << t.NumLeaves() << " leaves." << endl;
+
+	cout << "Calling PruneToQuality... ";
+	TripleTree pruned(t);
+	double predicted = pruned.PruneToQuality(psnr);
+	cout << "done." << endl;
+	cout << "Pruned tree contains " << pruned.NumLeaves() << " leaves." << endl;
+
+	PNG output = pruned.Render();
+	double measured = MeasurePSNR(input, output);
+	cout << "Predicted PSNR " << predicted << " dB, measured " << measured << " dB, "
+		<< (predicted == measured || fabs(predicted - measured) < 0.01 ? "matching" : "NOT MATCHING") << ", "
+		<< (measured >= psnr ? "meets" : "MISSES") << " the target." << endl;
+
+	TripleTree refined(t);
+	refined.SetIncrementalPrune(true);
+	refined.Prune(0.3);
+	refined.PruneToQuality(psnr);
+	cout << "With incremental pruning: render "
+		<< (refined.Render() == output ? "matches" : "DIFFERS FROM") << " the pruned render." << endl;
+
+	output.writeToFile("images-output/" + ImageName(image_num) + "-prune-quality.png");
+
+	cout << "Exiting TestPruneToQuality.\n" << endl;
+}
+
+void TestFusedPrune(int image_num, double tol) {
+	cout << "Entered TestFusedPrune, tolerance: " << tol << endl;
+
+	// read input PNG
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	PNG input;
+	input.readFromFile(input_path);
+
+	cout << "Constructing and pruning TripleTree from image... ";
+	TripleTree t(input);
+	t.Prune(tol);
+	cout << "done, " << t.NumLeaves() << " leaves." << endl;
+
+	cout << "Constructing pruned TripleTree in one pass... ";
+	TripleTree fused(input, tol);
+	cout << "done, " << fused.NumLeaves() << " leaves." << endl;
+
+	PNG output = fused.Render();
+	cout << "Render " << (output == t.Render() ? "matches" : "DIFFERS FROM") << " the pruned render." << endl;
+
+	// the leaves keep their error from the build, as in a pruned tree
+	t.PruneToQuality(25);
+	fused.PruneToQuality(25);
+	cout << "PruneToQuality afterwards " << (fused.Render() == t.Render() ? "matches" : "DIFFERS FROM")
+		<< " the pruned tree's." << endl;
+
+	output.writeToFile("images-output/" + ImageName(image_num) + "-prune-fused.png");
+
+	cout << "Exiting TestFusedPrune.\n" << endl;
+}
+
+void TestSummedAreaTable(int image_num, double tol) {
+	cout << "Entered TestSummedAreaTable, tolerance: " << tol << endl;
+
+	// read input PNG
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	PNG input;
+	input.readFromFile(input_path);
+
+	cout << "Building summed-area table... ";
+	SummedAreaTable table(input);
+	cout << "done." << endl;
+
+	// compare the table's averages against sums taken pixel by pixel
+	int mismatches = 0;
+	unsigned int w = input.width(), h = input.height();
+	for (unsigned int y = 0; y < h; y += 1 + h / 7) {
+		for (unsigned int x = 0; x < w; x += 1 + w / 7) {
+			unsigned int rw = w - x, rh = h - y;
+			unsigned long r = 0, g = 0, b = 0;
+			for (unsigned int j = y; j < y + rh; j++) {
+				for (unsigned int i = x; i < x + rw; i++) {
+					r += input.getPixel(i, j)->r;
+					g += input.getPixel(i, j)->g;
+					b += input.getPixel(i, j)->b;
+				}
+			}
+			RGBAPixel avg = table.Average(x, y, rw, rh);
+			unsigned long n = (unsigned long) rw * rh;
+			if (avg.r != r / n || avg.g != g / n || avg.b != b / n) {
+				mismatches++;
+			}
+		}
+	}
+	cout << "Table averages differ from pixel sums in " << mismatches << " regions." << endl;
+
+	cout << "Constructing TripleTree from table... ";
+	TripleTree full(input, table, -1);
+	cout << "done, " << full.NumLeaves() << " leaves." << endl;
+	cout << "Render " << (full.Render() == input ? "matches" : "DIFFERS FROM") << " the input." << endl;
+
+	cout << "Constructing TripleTree from table, pruning by variance... ";
+	TripleTree pruned(input, table, tol);
+	cout << "done, " << pruned.NumLeaves() << " leaves." << endl;
+
+	PNG output = pruned.Render();
+	output.writeToFile("images-output/" + ImageName(image_num) + "-summed-area.png");
+
+	PNG empty;
+	SummedAreaTable emptyTable(empty);
+	TripleTree none(empty, emptyTable, tol);
+	PNG blank = none.Render();
+	cout << "Tree of an empty image has " << none.NumLeaves() << " leaves and renders "
+		<< blank.width() << "x" << blank.height() << ", region " << none.RenderRegion(0, 0, 2, 2).width()
+		<< " wide, ColorAt " << (none.ColorAt(0, 0) == RGBAPixel() ? "default" : "NOT DEFAULT") << "." << endl;
+
+	cout << "Exiting TestSummedAreaTable.\n" << endl;
+}
+
+void TestLazyExpansion(int image_num, double tol) {
+	cout << "Entered TestLazyExpansion, tolerance: " << tol << endl;
+
+	// read input PNG
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	PNG input;
+	input.readFromFile(input_path);
+
+	SummedAreaTable table(input);
+	TripleTree eager(input, table, tol);
+
+	// each lazy tree is only ever asked one kind of question before Render,
+	// so whatever it built for that question alone must match the eager tree
+	cout << "Constructing lazy TripleTrees... ";
+	TripleTree shallow(input, table, tol, true);
+	TripleTree region(input, table, tol, true);
+	TripleTree queried(input, table, tol, true);
+	cout << "done." << endl;
+
+	cout << "Render(3) " << (shallow.Render(3) == eager.Render(3) ? "matches" : "DIFFERS FROM")
+		<< " the eager tree's." << endl;
+
+	unsigned int w = input.width(), h = input.height();
+	cout << "RenderRegion " << (region.RenderRegion(w / 4, h / 4, w / 3, h / 3) == eager.RenderRegion(w / 4, h / 4, w / 3, h / 3) ? "matches" : "DIFFERS FROM")
+		<< " the eager tree's." << endl;
+
+	int mismatches = 0;
+	for (unsigned int y = 0; y < h; y += 1 + h / 7) {
+		for (unsigned int x = 0; x < w; x += 1 + w / 7) {
+			if (queried.ColorAt(x, y) != eager.ColorAt(x, y)) {
+				mismatches++;
+			}
+		}
+	}
+	cout << "ColorAt differs from the eager tree's at " << mismatches << " points." << endl;
+
+	cout << "Render after expanding " << (shallow.Render() == eager.Render() && region.Render() == eager.Render() ? "matches" : "DIFFERS FROM")
+		<< " the eager tree's." << endl;
+	queried.Expand();
+	cout << "Expanded tree has " << queried.NumLeaves() << " leaves, eager tree " << eager.NumLeaves() << "." << endl;
+
+	PNG output = region.RenderRegion(w / 4, h / 4, w / 3, h / 3);
+	output.writeToFile("images-output/" + ImageName(image_num) + "-lazy-region.png");
+
+	cout << "Exiting TestLazyExpansion.\n" << endl;
+}
+
+void TestNodeBudget(int image_num) {
+	cout << "Entered TestNodeBudget" << endl;
+
+	// read input PNG
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	PNG original;
+	original.readFromFile(input_path);
+	PNG input = original;
+	// only subtrees of 256 to 1024 pixels are evicted, so smaller images are
+	// scaled up to have some, and an image that failed to load is replaced
+	if ((size_t) original.width() * original.height() < 4096) {
+		input = PNG(256, 256);
+		for (unsigned int y = 0; y < 256; y++) {
+			for (unsigned int x = 0; x < 256; x++) {
+				*input.getPixel(x, y) = (original.width() == 0 || original.height() == 0)
+					? RGBAPixel(x, y, (x + y) / 2)
+					: *original.getPixel(x * original.width() / 256, y * original.height() / 256);
+			}
+		}
+		cout << "Scaled the image to 256x256 to have subtrees to evict." << endl;
+	}
+	unsigned int w = input.width(), h = input.height();
+
+	SummedAreaTable table(input);
+	TripleTree eager(input, table, -1);
+	PNG expected = eager.RenderRegion(0, 0, w, h);
+
+	{
+		// a budget too large to evict anything, to count the nodes of a whole tree
+		TripleTree::SetNodeBudget(numeric_limits<size_t>::max());
+		TripleTree first(input, table, -1, true);
+		first.RenderRegion(0, 0, w, h);
+		size_t whole = TripleTree::BudgetedNodes();
+		cout << "One expanded tree holds " << whole << " nodes." << endl;
+		TripleTree second(input, table, -1, true);
+
+		size_t limit = max<size_t>(1, whole / 2);
+		TripleTree::SetNodeBudget(limit);
+		cout << "After halving the budget the trees hold " << TripleTree::BudgetedNodes() << " nodes, "
+			<< (TripleTree::BudgetedNodes() <= limit ? "within" : "OVER") << " the budget." << endl;
+
+		PNG region = second.RenderRegion(0, 0, w, h);
+		cout << "Render of the second tree " << (region == expected ? "matches" : "DIFFERS FROM") << " the eager tree's, "
+			<< (TripleTree::BudgetedNodes() <= limit ? "within" : "OVER") << " the budget." << endl;
+
+		// the first tree's subtrees were evicted to make room, and are built again
+		int mismatches = 0;
+		for (unsigned int y = 0; y < h; y += 1 + h / 7) {
+			for (unsigned int x = 0; x < w; x += 1 + w / 7) {
+				if (first.ColorAt(x, y) != eager.ColorAt(x, y)) {
+					mismatches++;
+				}
+			}
+		}
+		cout << "ColorAt on the first tree differs from the eager tree's at " << mismatches << " points." << endl;
+		cout << "Render of the first tree " << (first.RenderRegion(0, 0, w, h) == expected ? "matches" : "DIFFERS FROM")
+			<< " the eager tree's." << endl;
+
+		PNG output = first.Render(w / 2 + 1, h / 2 + 1);
+		output.writeToFile("images-output/" + ImageName(image_num) + "-budget-thumbnail.png");
+		TripleTree::SetNodeBudget(0);
+	}
+
+	{
+		// Render, NumLeaves and Write trim after every subtree they finish, so a
+		// tree never holds much more than the budget while they run
+		size_t limit = max<size_t>(1, (size_t) w * h / 4);
+		size_t slack = 2 * 1024 + (size_t) w * h / 256; // one evictable subtree and the nodes above them
+		TripleTree::SetNodeBudget(limit);
+		TripleTree fresh(input, table, -1, true);
+		PNG render = fresh.Render();
+		uint64_t leaves = fresh.NumLeaves();
+		stringstream written, expectedWritten;
+		fresh.Write(written);
+		eager.Write(expectedWritten);
+		size_t peak = TripleTree::PeakBudgetedNodes();
+		cout << "Render of a fresh tree " << (render == expected ? "matches" : "DIFFERS FROM") << " the eager tree's, NumLeaves "
+			<< (leaves == eager.NumLeaves() ? "matches" : "DIFFERS") << ", Write "
+			<< (written.str() == expectedWritten.str() ? "matches" : "DIFFERS") << "." << endl;
+		cout << "The trees held at most " << peak << " nodes meanwhile, "
+			<< (peak <= limit + slack ? "within" : "OVER") << " the budget of " << limit << " and one subtree." << endl;
+		TripleTree::SetNodeBudget(0);
+	}
+
+	{
+		// a tree read lazily from its file rebuilds evicted subtrees from the file alone
+		string file_path = "images-output/" + ImageName(image_num) + "-budget.ttree";
+		eager.WriteToFile(file_path);
+		MappedTripleTree mapped;
+		mapped.Open(file_path);
+		TripleTree loaded(mapped);
+		cout << "Tree read from the file " << (loaded.RenderRegion(0, 0, w, h) == expected ? "matches" : "DIFFERS FROM")
+			<< " the eager tree's." << endl;
+		TripleTree pruned(eager), prunedLoaded(loaded);
+		pruned.PruneByVariance(0.005);
+		prunedLoaded.PruneByVariance(0.005);
+		cout << "Pruned by variance, the tree read from the file has " << prunedLoaded.NumLeaves() << " leaves, the eager tree "
+			<< pruned.NumLeaves() << "." << endl;
+
+		size_t limit = max<size_t>(1, (size_t) w * h / 2);
+		TripleTree::SetNodeBudget(limit);
+		TripleTree lazy(mapped, true);
+		PNG region = lazy.RenderRegion(0, 0, w, h);
+		cout << "Render of the tree read lazily " << (region == expected ? "matches" : "DIFFERS FROM") << " the eager tree's, "
+			<< (TripleTree::BudgetedNodes() <= limit ? "within" : "OVER") << " the budget." << endl;
+		int mismatches = 0;
+		for (unsigned int y = 0; y < h; y += 1 + h / 7) {
+			for (unsigned int x = 0; x < w; x += 1 + w / 7) {
+				if (lazy.ColorAt(x, y) != eager.ColorAt(x, y)) {
+					mismatches++;
+				}
+			}
+		}
+		cout << "ColorAt on the tree read lazily differs from the eager tree's at " << mismatches << " points, "
+			<< (TripleTree::BudgetedNodes() <= limit ? "within" : "OVER") << " the budget." << endl;
+		TripleTree::SetNodeBudget(0);
+	}
+	cout << "Budgeted trees hold " << TripleTree::BudgetedNodes() << " nodes once destroyed." << endl;
+
+	cout << "Exiting TestNodeBudget.\n" << endl;
+}
+
+void TestSharedTree(int image_num) {
+	cout << "Entered TestSharedTree" << endl;
+
+	// read input PNG
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	PNG input;
+	input.readFromFile(input_path);
+
+	// every render a reader may see: the tree after 0 to 3 rotations, then pruned
+	TripleTree expected(input);
+	vector<PNG> states;
+	for (int i = 0; i < 4; i++) {
+		states.push_back(expected.Render());
+		expected.RotateCCW();
+	}
+	expected.Prune(0.1);
+	states.push_back(expected.Render());
+
+	SharedTripleTree shared{ TripleTree(input) };
+	shared_ptr<const TripleTree> first = shared.Snapshot();
+
+	cout << "Rendering on 4 threads while rotating and pruning... ";
+	atomic<bool> done(false);
+	atomic<int> renders(0), mismatches(0);
+	vector<thread> readers;
+	for (int t = 0; t < 4; t++) {
+		readers.emplace_back([&]() {
+			// at least a few renders each, however quickly the writer finishes
+			for (int i = 0; i < 20 || !done; i++) {
+				PNG render = shared.Render();
+				if (find(states.begin(), states.end(), render) == states.end()) {
+					mismatches++;
+				}
+				renders++;
+			}
+		});
+	}
+	for (int i = 0; i < 3; i++) {
+		shared.Update([](TripleTree& tree) { tree.RotateCCW(); });
+	}
+	shared.Update([](TripleTree& tree) { tree.RotateCCW(); tree.Prune(0.1); });
+	done = true;
+	for (thread& reader : readers) {
+		reader.join();
+	}
+	cout << "done." << endl;
+	cout << mismatches << " of " << renders << " renders matched no published tree." << endl;
+
+	cout << "Final snapshot " << (shared.Render() == states[4] ? "matches" : "DIFFERS FROM") << " the pruned tree, "
+		<< shared.NumLeaves() << " leaves." << endl;
+	cout << "First snapshot " << (first->Render() == states[0] ? "is unchanged" : "WAS CHANGED") << "." << endl;
+
+	// one thread clones the nodes of a copy while another destroys the copy
+	// sharing them, so some clones take the last reference to their node
+	cout << "Rotating copies while destroying their siblings on another thread... ";
+	TripleTree unpruned(input);
+	uint64_t liveBefore = unpruned.Stats().nodesLive;
+	for (int round = 0; round < 20; round++) {
+		TripleTree unsharing(unpruned);
+		unsharing.FlipHorizontal(); // its nodes are now shared with the sibling only
+		TripleTree *sibling = new TripleTree(unsharing);
+		thread destroyer([sibling]() { delete sibling; });
+		unsharing.RotateCCW();
+		destroyer.join();
+	}
+	cout << "done." << endl;
+	uint64_t liveAfter = unpruned.Stats().nodesLive;
+	cout << "Live nodes " << (liveAfter == liveBefore ? "balance" : "DO NOT BALANCE") << ": "
+		<< liveBefore << " before, " << liveAfter << " after." << endl;
+
+	PNG output = shared.RenderRegion(0, 0, input.width(), input.height());
+	output.writeToFile("images-output/" + ImageName(image_num) + "-shared.png");
+
+	cout << "Exiting TestSharedTree.\n" << endl;
+}
+
+void TestTiledForest(int image_num, unsigned int tileSize, double tol) {
+	cout << "Entered TestTiledForest, tile size: " << tileSize << ", tolerance: " << tol << endl;
+
+	// read input PNG
+	string input_path = "images-original/" + ImageName(image_num) + ".png";
+	PNG input;
+	input.readFromFile(input_path);
+	unsigned int w = input.width(), h = input.height();
+
+	cout << "Constructing TiledForest on 4 threads... ";
+	TiledForest forest(input, tileSize, 4);
+	cout << "done, " << forest.tilesAcross() << "x" << forest.tilesDown() << " tiles, " << forest.NumLeaves() << " leaves." << endl;
+	cout << "Render " << (forest.Render() == input ? "matches" : "DIFFERS FROM") << " the input." << endl;
+
+	int mismatches = 0;
+	for (unsigned int y = 0; y < h; y += 1 + h / 7) {
+		for (unsigned int x = 0; x < w; x += 1 + w / 7) {
+			if (forest.ColorAt(x, y) != *input.getPixel(x, y)) {
+				mismatches++;
+			}
+		}
+	}
+	cout << "ColorAt differs from the input at " << mismatches << " points." << endl;
+
+	PNG overview = forest.Overview().Render();
+	cout << "Overview is " << overview.width() << "x" << overview.height() << "." << endl;
+
+	// pruning on one thread or several must give the same tiles
+	TiledForest serial(input, tileSize, 1);
+	serial.Prune(tol);
+	forest.Prune(tol);
+	PNG output = forest.Render();
+	cout << "Pruned forest has " << forest.NumLeaves() << " leaves, "
+		<< (output == serial.Render() ? "matching" : "DIFFERENT FROM") << " the forest pruned on one thread." << endl;
+
+	PNG region = forest.RenderRegion(w / 4, h / 4, w / 2, h / 2);
+	int regionMismatches = 0;
+	for (unsigned int y = 0; y < region.height(); y++) {
+		for (unsigned int x = 0; x < region.width(); x++) {
+			if (*region.getPixel(x, y) != *output.getPixel(w / 4 + x, h / 4 + y)) {
+				regionMismatches++;
+			}
+		}
+	}
+	cout << "RenderRegion differs from the full render at " << regionMismatches << " pixels." << endl;
+
+	output.writeToFile("images-output/" + ImageName(image_num) + "-tiled-prune.png");
+
+	cout << "Exiting TestTiledForest.\n" << endl;
+}
@@ -0,0 +1,294 @@
+/**
+ * @file        mappedtree.cpp
+ *
+ */
+
+#include "mappedtree.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedTripleTree::MappedTripleTree() {
+    map = nullptr;
+    mapSize = 0;
+    nodes = nullptr;
+    count = 0;
+    total = 0;
+    leafCount = 0;
+}
+
+MappedTripleTree::~MappedTripleTree() {
+    Close();
+}
+
+/**
+ * Maps a file written by TripleTree::WriteToFile.
+ * Only the header is inspected here; node pages are faulted in by the
+ * first query that touches them.
+ * @param fileName - name of the file to be mapped.
+ */
+bool MappedTripleTree::Open(const string& fileName) {
+    Close();
+
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "MappedTripleTree: cannot open " << fileName << endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(FlatHeader)) {
+        cerr << "MappedTripleTree: " << fileName << " is too small" << endl;
+        close(fd);
+        return false;
+    }
+    void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping keeps its own reference to the file
+    close(fd);
+    if (m == MAP_FAILED) {
+        cerr << "MappedTripleTree: mmap of " << fileName << " failed" << endl;
+        return false;
+    }
+    if (!Attach(m, st.st_size)) {
+        cerr << "MappedTripleTree: " << fileName << " is not a TripleTree file" << endl;
+        munmap(m, st.st_size);
+        return false;
+    }
+    map = m;
+    mapSize = st.st_size;
+    return true;
+}
+
+/**
+ * Views a buffer holding the output of TripleTree::Write, or a prefix of it.
+ * @param data - start of the buffer.
+ * @param size - number of bytes available in the buffer.
+ */
+bool MappedTripleTree::Attach(const void* data, size_t size) {
+    if (data != map) {
+        Close();
+    }
+    if (size < sizeof(FlatHeader) + sizeof(FlatNode)) {
+        return false;
+    }
+    const FlatHeader* header = (const FlatHeader*) data;
+    if (memcmp(header->magic, "TTRE", 4) != 0 || header->version != FLAT_VERSION
+            || header->nodeCount == 0) {
+        return false;
+    }
+    uint64_t available = (size - sizeof(FlatHeader)) / sizeof(FlatNode);
+    nodes = (const FlatNode*) ((const char*) data + sizeof(FlatHeader));
+    total = header->nodeCount;
+    count = (available < total) ? available : total;
+    leafCount = header->leafCount;
+    return true;
+}
+
+/**
+ * Returns whether every node announced by the header is available.
+ */
+bool MappedTripleTree::Complete() const {
+    return count == total;
+}
+
+/**
+ * Unmaps the current file, if any, and forgets any attached buffer.
+ */
+void MappedTripleTree::Close() {
+    if (map != nullptr) {
+        munmap(map, mapSize);
+    }
+    map = nullptr;
+    mapSize = 0;
+    nodes = nullptr;
+    count = 0;
+    total = 0;
+    leafCount = 0;
+}
+
+/**
+ * Render returns a PNG image consisting of the leaf rectangles stored in
+ * the mapped file. Leaves tile the root's rectangle, so a single pass
+ * over the node array is enough and no child links are followed. Nodes
+ * whose children are missing from a partial buffer are painted first
+ * and overwritten by whichever children did arrive, which is safe
+ * because breadth-first order puts every parent before its children.
+ * Nodes whose children do not follow them are leaves, as in
+ * Render(maxDepth) and RenderRegion.
+ */
+PNG MappedTripleTree::Render() const {
+    if (count == 0) {
+        return PNG();
+    }
+    PNG png = PNG(nodes[0].width, nodes[0].height);
+    for (uint64_t i = 0; i < count; i++) {
+        const FlatNode& n = nodes[i];
+        // children must follow their parent; anything else is a damaged file
+        if (n.numChildren == 0 || n.firstChild <= i || n.firstChild + n.numChildren > count) {
+            fill(png, n);
+        }
+    }
+    return png;
+}
+
+/**
+ * Renders the tree as if every node at depth maxDepth were a leaf. Levels
+ * are contiguous in breadth-first order, so each level ends where the
+ * last child of the previous level ends and no depth is stored per node.
+ *
+ * @param maxDepth - deepest level of the tree to descend to.
+ */
+PNG MappedTripleTree::Render(int maxDepth) const {
+    if (count == 0) {
+        return PNG();
+    }
+    PNG png = PNG(nodes[0].width, nodes[0].height);
+    uint64_t begin = 0;
+    uint64_t end = 1;
+    for (int depth = 0; depth <= maxDepth && begin < end; depth++) {
+        uint64_t nextEnd = end;
+        for (uint64_t i = begin; i < end; i++) {
+            const FlatNode& n = nodes[i];
+            // children must follow their parent; anything else is a damaged file
+            if (depth == maxDepth || n.numChildren == 0 || n.firstChild <= i) {
+                fill(png, n);
+            } else {
+                if (n.firstChild + n.numChildren > count) {
+                    fill(png, n);
+                }
+                if (n.firstChild + n.numChildren > nextEnd) {
+                    nextEnd = n.firstChild + n.numChildren;
+                }
+            }
+        }
+        begin = end;
+        end = (nextEnd < count) ? nextEnd : count;
+    }
+    return png;
+}
+
+/**
+ * Renders only the given viewport into a PNG of the viewport's size. The
+ * walk keeps its own stack of node indices; a parent is always painted
+ * before its children are popped, so nodes whose children are missing
+ * from a partial buffer show through exactly where nothing finer arrived.
+ * Nodes whose children do not follow them, or lie outside them or over
+ * one another, are leaves, so a damaged file cannot lead the walk to a
+ * node twice.
+ *
+ * @param x - left edge of the viewport.
+ * @param y - top edge of the viewport.
+ * @param w - width of the viewport in pixels.
+ * @param h - height of the viewport in pixels.
+ */
+PNG MappedTripleTree::RenderRegion(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const {
+    PNG png = PNG(w, h);
+    if (count == 0 || w == 0 || h == 0) {
+        return png;
+    }
+    vector<uint64_t> stack;
+    stack.push_back(0);
+    while (!stack.empty()) {
+        uint64_t i = stack.back();
+        stack.pop_back();
+        const FlatNode& n = nodes[i];
+        unsigned long left = max((unsigned long) n.x, (unsigned long) x);
+        unsigned long top = max((unsigned long) n.y, (unsigned long) y);
+        unsigned long right = min((unsigned long) n.x + n.width, (unsigned long) x + w);
+        unsigned long bottom = min((unsigned long) n.y + n.height, (unsigned long) y + h);
+        if (left >= right || top >= bottom) {
+            continue;
+        }
+        bool leaf = n.numChildren == 0 || n.firstChild <= i || !nested(i);
+        if (leaf || n.firstChild + n.numChildren > count) {
+            RGBAPixel avg(n.r, n.g, n.b, n.a);
+            for (unsigned long py = top; py < bottom; py++) {
+                RGBAPixel *row = png.getPixel(left - x, py - y);
+                for (unsigned long px = 0; px < right - left; px++) {
+                    row[px] = avg;
+                }
+            }
+        }
+        if (!leaf) {
+            uint64_t last = min(n.firstChild + n.numChildren, count);
+            for (uint64_t c = n.firstChild; c < last; c++) {
+                stack.push_back(c);
+            }
+        }
+    }
+    return png;
+}
+
+/**
+ * Returns the number of leaf nodes in the complete tree, as recorded in
+ * the header.
+ */
+uint64_t MappedTripleTree::NumLeaves() const {
+    return leafCount;
+}
+
+uint64_t MappedTripleTree::NodeCount() const {
+    return count;
+}
+
+const FlatNode& MappedTripleTree::NodeAt(uint64_t index) const {
+    return nodes[index];
+}
+
+/**
+ * Returns whether the children of node i that are available lie inside
+ * its rectangle and do not overlap. In a walk that only descends into
+ * such nodes, any two nodes reached are nested or disjoint, so no node
+ * with pixels is reached twice.
+ *
+ * @param i - index of a node with children
+ */
+bool MappedTripleTree::nested(uint64_t i) const {
+    const FlatNode& n = nodes[i];
+    if (n.numChildren > 3) {
+        return false;
+    }
+    uint64_t last = min(n.firstChild + n.numChildren, count);
+    for (uint64_t c = n.firstChild; c < last; c++) {
+        const FlatNode& a = nodes[c];
+        if (a.x < n.x || a.y < n.y || (uint64_t) a.x + a.width > (uint64_t) n.x + n.width
+                || (uint64_t) a.y + a.height > (uint64_t) n.y + n.height) {
+            return false;
+        }
+        for (uint64_t d = n.firstChild; d < c; d++) {
+            const FlatNode& b = nodes[d];
+            if (a.x < (uint64_t) b.x + b.width && b.x < (uint64_t) a.x + a.width
+                    && a.y < (uint64_t) b.y + b.height && b.y < (uint64_t) a.y + a.height) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Paints a node's rectangle with its average color. Rectangles that would
+ * fall outside the canvas in a damaged file are skipped.
+ *
+ * @param img - canvas sized to the root's rectangle
+ * @param n - node to paint
+ */
+void MappedTripleTree::fill(PNG& img, const FlatNode& n) const {
+    // widened, so that a corrupt x + width cannot wrap around and pass
+    if ((uint64_t) n.x + n.width > img.width() || (uint64_t) n.y + n.height > img.height()) {
+        return;
+    }
+    RGBAPixel avg(n.r, n.g, n.b, n.a);
+    for (unsigned int y = 0; y < n.height; y++) {
+        RGBAPixel *row = img.getPixel(n.x, n.y + y);
+        for (unsigned int x = 0; x < n.width; x++) {
+            row[x] = avg;
+        }
+    }
+}
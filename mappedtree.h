@@ -0,0 +1,151 @@
+/**
+ * @file        mappedtree.h
+ *
+ */
+
+#ifndef _MAPPEDTREE_H_
+#define _MAPPEDTREE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "cs221util/PNG.h"
+#include "cs221util/RGBAPixel.h"
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * On-disk layout written by TripleTree::WriteToFile and read by
+ * MappedTripleTree. The file is a FlatHeader followed by nodeCount
+ * FlatNodes in breadth-first order, so the children of a node are
+ * stored contiguously starting at firstChild. Integers are stored in
+ * host byte order.
+ */
+struct FlatHeader {
+    char magic[4];       // "TTRE"
+    uint32_t version;    // FLAT_VERSION
+    uint64_t nodeCount;  // number of FlatNodes following the header
+    uint64_t leafCount;  // number of FlatNodes with no children
+};
+
+struct FlatNode {
+    uint32_t x;          // upper-left x coordinate of the node's subimage
+    uint32_t y;          // upper-left y coordinate of the node's subimage
+    uint32_t width;      // horizontal dimension of the subimage in pixels
+    uint32_t height;     // vertical dimension of the subimage in pixels
+    uint64_t firstChild; // index of the first child, 0 if numChildren == 0
+    double a;            // average alpha of the subimage
+    uint8_t r, g, b;     // average color of the subimage
+    uint8_t numChildren; // 0 (leaf), 2 (A and C) or 3 (A, B and C)
+    float var;           // the node's var (see Node), 0 in files written before it was kept
+};
+
+const uint32_t FLAT_VERSION = 1;
+
+/**
+ * A read-only TripleTree backed by a memory-mapped file. Nodes are
+ * addressed by index into the mapped array instead of by pointer, so
+ * the same file can be shared through the page cache by any number of
+ * processes, and opening a tree costs no parsing or allocation.
+ *
+ * Because nodes are stored breadth-first, a file or buffer holding only
+ * a prefix of the nodes is still a valid, coarser tree: nodes whose
+ * children have not arrived yet are rendered as leaves.
+ */
+class MappedTripleTree {
+
+public:
+    MappedTripleTree();
+    ~MappedTripleTree();
+
+    MappedTripleTree(const MappedTripleTree& other) = delete;
+    MappedTripleTree& operator=(const MappedTripleTree& rhs) = delete;
+
+    /**
+     * Maps a file written by TripleTree::WriteToFile.
+     * Unmaps any previously opened file.
+     * @param fileName - name of the file to be mapped.
+     * @return true, if the file was mapped and has a valid header.
+     */
+    bool Open(const string& fileName);
+
+    /**
+     * Views a buffer holding the output of TripleTree::Write, or any
+     * prefix of it that contains the header and at least one node.
+     * The buffer is not copied and must outlive this object.
+     * @param data - start of the buffer.
+     * @param size - number of bytes available in the buffer.
+     * @return true, if the buffer has a valid header.
+     */
+    bool Attach(const void* data, size_t size);
+
+    /**
+     * Returns whether every node announced by the header is available.
+     */
+    bool Complete() const;
+
+    /**
+     * Unmaps the current file, if any.
+     */
+    void Close();
+
+    /**
+     * Render returns a PNG image consisting of the leaf rectangles
+     * stored in the mapped file, exactly as TripleTree::Render would
+     * for the tree that was written.
+     */
+    PNG Render() const;
+
+    /**
+     * Renders the tree as if every node at depth maxDepth were a leaf,
+     * exactly as TripleTree::Render(maxDepth) would. Only the nodes of
+     * the first maxDepth + 1 levels are read.
+     *
+     * @param maxDepth - deepest level of the tree to descend to.
+     */
+    PNG Render(int maxDepth) const;
+
+    /**
+     * Renders only the given viewport into a PNG of the viewport's size,
+     * exactly as TripleTree::RenderRegion would. Child links are followed
+     * only into nodes that intersect the viewport.
+     *
+     * @param x - left edge of the viewport.
+     * @param y - top edge of the viewport.
+     * @param w - width of the viewport in pixels.
+     * @param h - height of the viewport in pixels.
+     */
+    PNG RenderRegion(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const;
+
+    /**
+     * Returns the number of leaf nodes in the complete tree.
+     */
+    uint64_t NumLeaves() const;
+
+    /**
+     * Returns the number of nodes available, fewer than the header
+     * announces if the buffer holds only a prefix of the file.
+     */
+    uint64_t NodeCount() const;
+
+    /**
+     * Returns the node at the given breadth-first index.
+     * @param index - index of the node, below NodeCount().
+     */
+    const FlatNode& NodeAt(uint64_t index) const;
+
+private:
+    void* map;           // start of the mapping, nullptr if nothing is open
+    size_t mapSize;      // size of the mapping in bytes
+    const FlatNode* nodes;
+    uint64_t count;      // number of nodes available
+    uint64_t total;      // number of nodes announced by the header
+    uint64_t leafCount;
+
+    void fill(PNG& img, const FlatNode& n) const;
+    bool nested(uint64_t i) const;
+};
+
+#endif
@@ -0,0 +1,40 @@
+/**
+ * @file        sharedtree.cpp
+ *
+ */
+
+#include "sharedtree.h"
+
+SharedTripleTree::SharedTripleTree(TripleTree&& tree) {
+    tree.Expand();
+    atomic_store(&current, shared_ptr<const TripleTree>(make_shared<TripleTree>(std::move(tree))));
+}
+
+shared_ptr<const TripleTree> SharedTripleTree::Snapshot() const {
+    return atomic_load(&current);
+}
+
+/**
+ * The copy shares the snapshot's nodes, so it costs O(1), and the change
+ * clones the shared nodes it modifies (see TripleTree::Unshare) instead of
+ * writing to nodes readers may be visiting.
+ */
+void SharedTripleTree::Update(const function<void(TripleTree&)>& change) {
+    lock_guard<mutex> guard(writer);
+    shared_ptr<TripleTree> next = make_shared<TripleTree>(*atomic_load(&current));
+    change(*next);
+    next->Expand();
+    atomic_store(&current, shared_ptr<const TripleTree>(next));
+}
+
+PNG SharedTripleTree::Render() const {
+    return Snapshot()->Render();
+}
+
+PNG SharedTripleTree::RenderRegion(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const {
+    return Snapshot()->RenderRegion(x, y, w, h);
+}
+
+uint64_t SharedTripleTree::NumLeaves() const {
+    return Snapshot()->NumLeaves();
+}
@@ -0,0 +1,82 @@
+/**
+ * @file        sharedtree.h
+ *
+ */
+
+#ifndef _SHAREDTREE_H_
+#define _SHAREDTREE_H_
+
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "tripletree.h"
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * A TripleTree that many threads can read while others change it. Readers
+ * take a snapshot, an immutable tree that stays valid for as long as they
+ * hold it, and query it without any lock. A writer copies the current
+ * tree, which shares every node, changes the copy, cloning only the nodes
+ * it touches, and then publishes it as the new snapshot. Readers never
+ * wait for a flip, rotation or prune: until it is published they keep
+ * seeing the previous tree, and a snapshot taken before is not affected.
+ * A snapshot's nodes are freed once the last reader holding it lets go.
+ *
+ * Writers are serialized among themselves. Publishing and taking a
+ * snapshot are single atomic shared_ptr operations.
+ */
+class SharedTripleTree {
+
+public:
+    /**
+     * Publishes tree as the first snapshot. A lazy tree is expanded
+     * first, since readers must not build nodes.
+     *
+     * @param tree - the tree to share, moved from
+     */
+    explicit SharedTripleTree(TripleTree&& tree);
+
+    /**
+     * Returns the current tree. It never changes, and may be kept and
+     * queried from any thread for as long as the caller likes.
+     */
+    shared_ptr<const TripleTree> Snapshot() const;
+
+    /**
+     * Applies change to a copy of the current tree and publishes the
+     * result. Only the nodes change modifies are copied. Incremental
+     * pruning state is not carried from one snapshot to the next.
+     *
+     * @param change - modifies the tree it is given, e.g. by rotating it
+     */
+    void Update(const function<void(TripleTree&)>& change);
+
+    /**
+     * Renders the current snapshot.
+     */
+    PNG Render() const;
+
+    /**
+     * Renders a viewport of the current snapshot.
+     *
+     * @param x - left edge of the viewport.
+     * @param y - top edge of the viewport.
+     * @param w - width of the viewport in pixels.
+     * @param h - height of the viewport in pixels.
+     */
+    PNG RenderRegion(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const;
+
+    /**
+     * Returns the number of leaves of the current snapshot.
+     */
+    uint64_t NumLeaves() const;
+
+private:
+    shared_ptr<const TripleTree> current; // only accessed through atomic_load and atomic_store
+    mutex writer;                         // held by Update for its whole copy, change and publish
+};
+
+#endif
@@ -0,0 +1,74 @@
+/**
+ * @file        summedarea.cpp
+ *
+ */
+
+#include "summedarea.h"
+
+#include <algorithm>
+
+/**
+ * The table is built a row at a time: a running sum along the row, then
+ * the row above added in. Entries are plain arrays of eight numbers, laid
+ * out so that both loops compile to vector adds over whole entries.
+ */
+SummedAreaTable::SummedAreaTable(const PNG& im) {
+    width_ = im.width();
+    height_ = im.height();
+    size_t stride = (size_t) width_ + 1;
+    table.assign(stride * ((size_t) height_ + 1), RegionSums());
+
+    for (unsigned int y = 0; y < height_; y++) {
+        RegionSums *above = &table[y * stride];
+        RegionSums *row = &table[(y + 1) * stride];
+        const RGBAPixel *pixels = im.getPixel(0, y);
+        RegionSums running = RegionSums();
+        for (unsigned int x = 0; x < width_; x++) {
+            const RGBAPixel &p = pixels[x];
+            running.sum[0] += p.r;
+            running.sum[1] += p.g;
+            running.sum[2] += p.b;
+            running.sumsq[0] += p.r * p.r;
+            running.sumsq[1] += p.g * p.g;
+            running.sumsq[2] += p.b * p.b;
+            running.alpha += p.a;
+            running.alphasq += p.a * p.a;
+            row[x + 1] = running;
+        }
+        for (unsigned int x = 1; x <= width_; x++) {
+            for (int i = 0; i < 3; i++) {
+                row[x].sum[i] += above[x].sum[i];
+                row[x].sumsq[i] += above[x].sumsq[i];
+            }
+            row[x].alpha += above[x].alpha;
+            row[x].alphasq += above[x].alphasq;
+        }
+    }
+}
+
+unsigned int SummedAreaTable::width() const {
+    return width_;
+}
+
+unsigned int SummedAreaTable::height() const {
+    return height_;
+}
+
+RegionSums SummedAreaTable::Sums(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const {
+    const RegionSums &a = at(x, y), &b = at(x + w, y), &c = at(x, y + h), &d = at(x + w, y + h);
+    RegionSums s;
+    for (int i = 0; i < 3; i++) {
+        s.sum[i] = d.sum[i] - b.sum[i] - c.sum[i] + a.sum[i];
+        s.sumsq[i] = d.sumsq[i] - b.sumsq[i] - c.sumsq[i] + a.sumsq[i];
+    }
+    s.alpha = (d.alpha - b.alpha) - (c.alpha - a.alpha);
+    s.alphasq = (d.alphasq - b.alphasq) - (c.alphasq - a.alphasq);
+    return s;
+}
+
+RGBAPixel SummedAreaTable::Average(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const {
+    RegionSums s = Sums(x, y, w, h);
+    uint64_t n = (uint64_t) w * h;
+    double a = min(max(s.alpha / n, 0.0), 1.0);
+    return RGBAPixel((int) (s.sum[0] / n), (int) (s.sum[1] / n), (int) (s.sum[2] / n), a);
+}
@@ -0,0 +1,84 @@
+/**
+ * @file        summedarea.h
+ *
+ */
+
+#ifndef _SUMMEDAREA_H_
+#define _SUMMEDAREA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "cs221util/PNG.h"
+#include "cs221util/RGBAPixel.h"
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * Sums of a rectangle's pixels and of their squares, with red, green and
+ * blue in 0..255 and alpha in [0, 1]. The color sums are exact.
+ */
+struct RegionSums {
+    uint64_t sum[3];     // red, green, blue
+    uint64_t sumsq[3];
+    double alpha;
+    double alphasq;
+};
+
+/**
+ * A summed-area table (integral image) of a PNG: entry (x, y) holds the
+ * RegionSums of the pixels above and to the left of (x, y), so the sums,
+ * average and variance of any rectangle take four lookups, however large
+ * it is. Building the table is two passes over the image.
+ *
+ * Each entry is a RegionSums of 64 bytes, so the table takes 64 bytes per
+ * pixel; it does not refer to the image once built.
+ */
+class SummedAreaTable {
+
+public:
+    /**
+     * Builds the table of an image.
+     * @param im - the image to sum
+     */
+    SummedAreaTable(const PNG& im);
+
+    unsigned int width() const;
+    unsigned int height() const;
+
+    /**
+     * Returns the sums of the pixels in a rectangle, which must lie
+     * within the image.
+     *
+     * @param x - left edge of the rectangle
+     * @param y - top edge of the rectangle
+     * @param w - width of the rectangle in pixels
+     * @param h - height of the rectangle in pixels
+     */
+    RegionSums Sums(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const;
+
+    /**
+     * Returns the average color of the pixels in a non-empty rectangle
+     * within the image, each color channel truncated like
+     * TripleTree's node averages.
+     *
+     * @param x - left edge of the rectangle
+     * @param y - top edge of the rectangle
+     * @param w - width of the rectangle in pixels
+     * @param h - height of the rectangle in pixels
+     */
+    RGBAPixel Average(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const;
+
+private:
+    unsigned int width_;
+    unsigned int height_;
+    vector<RegionSums> table; // (width_ + 1) x (height_ + 1), row 0 and column 0 zero
+
+    const RegionSums& at(unsigned int x, unsigned int y) const {
+        return table[(size_t) y * (width_ + 1) + x];
+    }
+};
+
+#endif
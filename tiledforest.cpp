@@ -0,0 +1,162 @@
+/**
+ * @file        tiledforest.cpp
+ *
+ */
+
+#include "tiledforest.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+
+/**
+ * Calls fn(i) for every i below count on up to threads threads, the
+ * calling thread included, each taking the next index as it finishes one.
+ */
+static void ParallelFor(size_t count, unsigned int threads, const function<void(size_t)>& fn) {
+    atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+            fn(i);
+        }
+    };
+    vector<thread> workers;
+    for (unsigned int t = 1; t < threads && t < count; t++) {
+        workers.push_back(thread(work));
+    }
+    work();
+    for (thread& worker : workers) {
+        worker.join();
+    }
+}
+
+/**
+ * Each thread copies its tile out of the image into a PNG of its own and
+ * builds from that, so at most one tile's copy per thread is alive.
+ */
+TiledForest::TiledForest(const PNG& im, unsigned int tileSize, unsigned int threads) {
+    width_ = im.width();
+    height_ = im.height();
+    tileSize_ = max(1u, tileSize);
+    across_ = width_ / tileSize_ + (width_ % tileSize_ != 0);
+    down_ = height_ / tileSize_ + (height_ % tileSize_ != 0);
+    threads_ = (threads > 0) ? threads : max(1u, thread::hardware_concurrency());
+    tiles.resize((size_t) across_ * down_);
+    ParallelFor(tiles.size(), threads_, [&](size_t i) {
+        unsigned int x = (i % across_) * tileSize_, y = (i / across_) * tileSize_;
+        unsigned int w = min(tileSize_, width_ - x), h = min(tileSize_, height_ - y);
+        PNG tile(w, h);
+        for (unsigned int row = 0; row < h; row++) {
+            copy(im.getPixel(x, y + row), im.getPixel(x, y + row) + w, tile.getPixel(0, row));
+        }
+        tiles[i].reset(new TripleTree(tile));
+    });
+    if (!tiles.empty()) {
+        BuildOverview();
+    }
+}
+
+unsigned int TiledForest::width() const {
+    return width_;
+}
+
+unsigned int TiledForest::height() const {
+    return height_;
+}
+
+unsigned int TiledForest::tileSize() const {
+    return tileSize_;
+}
+
+unsigned int TiledForest::tilesAcross() const {
+    return across_;
+}
+
+unsigned int TiledForest::tilesDown() const {
+    return down_;
+}
+
+const TripleTree& TiledForest::Tile(unsigned int col, unsigned int row) const {
+    return *tiles[(size_t) row * across_ + col];
+}
+
+const TripleTree& TiledForest::Overview() const {
+    return *overview;
+}
+
+uint64_t TiledForest::NumLeaves() const {
+    uint64_t leaves = 0;
+    for (const unique_ptr<TripleTree>& tile : tiles) {
+        leaves += tile->NumLeaves();
+    }
+    return leaves;
+}
+
+void TiledForest::Prune(double tol) {
+    ParallelFor(tiles.size(), threads_, [&](size_t i) {
+        tiles[i]->Prune(tol);
+    });
+    BuildOverview();
+}
+
+PNG TiledForest::Render() const {
+    return RenderRegion(0, 0, width_, height_);
+}
+
+PNG TiledForest::RenderRegion(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const {
+    PNG png(w, h);
+    if (w == 0 || h == 0 || x >= width_ || y >= height_) {
+        return png;
+    }
+    // the tiles the viewport intersects; each writes its own part of png
+    unsigned int col0 = x / tileSize_, row0 = y / tileSize_;
+    unsigned int col1 = min((unsigned long) across_, ((unsigned long) x + w - 1) / tileSize_ + 1);
+    unsigned int row1 = min((unsigned long) down_, ((unsigned long) y + h - 1) / tileSize_ + 1);
+    unsigned int cols = col1 - col0;
+    ParallelFor((size_t) cols * (row1 - row0), threads_, [&](size_t i) {
+        CopyTile(png, col0 + i % cols, row0 + i / cols, x, y, w, h);
+    });
+    return png;
+}
+
+RGBAPixel TiledForest::ColorAt(unsigned int x, unsigned int y) const {
+    if (x >= width_ || y >= height_) {
+        return RGBAPixel();
+    }
+    return Tile(x / tileSize_, y / tileSize_).ColorAt(x % tileSize_, y % tileSize_);
+}
+
+/**
+ * Makes the overview from each tile's area-weighted average color.
+ */
+void TiledForest::BuildOverview() {
+    PNG thumbnail(across_, down_);
+    for (unsigned int row = 0; row < down_; row++) {
+        for (unsigned int col = 0; col < across_; col++) {
+            unsigned int w = min(tileSize_, width_ - col * tileSize_), h = min(tileSize_, height_ - row * tileSize_);
+            *thumbnail.getPixel(col, row) = Tile(col, row).AverageOver(0, 0, w, h);
+        }
+    }
+    overview.reset(new TripleTree(thumbnail));
+}
+
+/**
+ * Renders the part of a tile inside the viewport (x, y, w, h) into out,
+ * which is the size of the viewport.
+ */
+void TiledForest::CopyTile(PNG& out, unsigned int col, unsigned int row, unsigned int x, unsigned int y, unsigned int w, unsigned int h) const {
+    unsigned long tileX = (unsigned long) col * tileSize_, tileY = (unsigned long) row * tileSize_;
+    unsigned long left = max(tileX, (unsigned long) x);
+    unsigned long top = max(tileY, (unsigned long) y);
+    unsigned long right = min(min(tileX + tileSize_, (unsigned long) width_), (unsigned long) x + w);
+    unsigned long bottom = min(min(tileY + tileSize_, (unsigned long) height_), (unsigned long) y + h);
+    if (left >= right || top >= bottom) {
+        return;
+    }
+    PNG part = Tile(col, row).RenderRegion(left - tileX, top - tileY, right - left, bottom - top);
+    for (unsigned long py = top; py < bottom; py++) {
+        const RGBAPixel *src = part.getPixel(0, py - top);
+        copy(src, src + (right - left), out.getPixel(left - x, py - y));
+    }
+}
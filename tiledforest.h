@@ -0,0 +1,114 @@
+/**
+ * @file        tiledforest.h
+ *
+ */
+
+#ifndef _TILEDFOREST_H_
+#define _TILEDFOREST_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "tripletree.h"
+#include "cs221util/PNG.h"
+#include "cs221util/RGBAPixel.h"
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * An image too large for one TripleTree, kept as a grid of square tiles
+ * with a TripleTree each, plus an overview tree over the tiles. Tiles are
+ * built, pruned and rendered in parallel, each by one thread, and every
+ * tree only ever holds one tile's coordinates and pixel counts, so the
+ * image may have more pixels than 32-bit counts allow.
+ *
+ * A tile is pruned on its own against its own averages, and no leaf ever
+ * spans two tiles, so a pruned forest differs somewhat from one pruned
+ * tree of the image.
+ */
+class TiledForest {
+
+public:
+    /**
+     * Builds a tree for every tile of the image. An empty image gives a
+     * forest with no tiles, whose Overview must not be used.
+     *
+     * @param im - the input image
+     * @param tileSize - width and height of a tile, except in the last
+     *                   column and row, which take what is left
+     * @param threads - number of threads to build with, or 0 for one per core
+     */
+    TiledForest(const PNG& im, unsigned int tileSize, unsigned int threads = 0);
+
+    unsigned int width() const;
+    unsigned int height() const;
+    unsigned int tileSize() const;
+    unsigned int tilesAcross() const;
+    unsigned int tilesDown() const;
+
+    /**
+     * Returns the tree of the tile in column col and row row. Its
+     * coordinates are relative to the tile's upper left corner, which is
+     * at (col * tileSize(), row * tileSize()) in the image.
+     */
+    const TripleTree& Tile(unsigned int col, unsigned int row) const;
+
+    /**
+     * Returns the tree of a tilesAcross() by tilesDown() image whose
+     * pixels are the average colors of the tiles; rendering it gives a
+     * thumbnail with one pixel per tile.
+     */
+    const TripleTree& Overview() const;
+
+    /**
+     * Returns the number of leaves of all of the tiles.
+     */
+    uint64_t NumLeaves() const;
+
+    /**
+     * Prunes every tile as TripleTree::Prune does, and rebuilds the
+     * overview from the pruned tiles.
+     *
+     * @param tol - maximum allowable color distance to qualify for pruning
+     */
+    void Prune(double tol);
+
+    /**
+     * Renders the whole image, each tile by one thread.
+     */
+    PNG Render() const;
+
+    /**
+     * Renders only the given viewport, visiting only the tiles it
+     * intersects.
+     *
+     * @param x - left edge of the viewport.
+     * @param y - top edge of the viewport.
+     * @param w - width of the viewport in pixels.
+     * @param h - height of the viewport in pixels.
+     */
+    PNG RenderRegion(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const;
+
+    /**
+     * Returns the color that Render() would give pixel (x, y), or a
+     * default pixel outside the image.
+     */
+    RGBAPixel ColorAt(unsigned int x, unsigned int y) const;
+
+private:
+    unsigned int width_;
+    unsigned int height_;
+    unsigned int tileSize_;
+    unsigned int across_;
+    unsigned int down_;
+    unsigned int threads_;
+    vector<unique_ptr<TripleTree>> tiles; // row by row
+    unique_ptr<TripleTree> overview;
+
+    void BuildOverview();
+    void CopyTile(PNG& out, unsigned int col, unsigned int row, unsigned int x, unsigned int y, unsigned int w, unsigned int h) const;
+};
+
+#endif
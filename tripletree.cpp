@@ -4,6 +4,90 @@
  */
 
 #include "tripletree.h"
+#include "mappedtree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <unistd.h>
+
+/**
+ * Nodes allocated by any tree and not yet freed, only maintained when
+ * built with TRIPLETREE_STATS. Nodes shared between trees may be freed by
+ * a tree other than the one that allocated them, so the count is
+ * process-wide.
+ */
+static atomic<uint64_t> liveNodes(0);
+
+/**
+ * Every split node of a tree that prunes incrementally, with the children
+ * it has while collapsed. Collapsing or expanding a node swaps its
+ * children with those of its entry, so a node is collapsed exactly when
+ * its entry holds its children.
+ */
+struct TripleTree::Refinement {
+    struct Entry {
+        double threshold; // smallest tol that prunes the node
+        Node *node;
+        Node *A, *B, *C;  // node's children while it is collapsed
+    };
+    vector<Entry> entries;     // sorted by threshold
+    double tol;                // nodes with threshold <= tol are collapsed
+    PruneThreshold threshold;  // how the thresholds were computed, or nullptr
+};
+
+/**
+ * What a lazy tree builds its missing children from: an image and its
+ * summed-area table, or a mapped tree file. pending counts the nodes
+ * whose children are still to be built; once it reaches 0 the source is
+ * dropped, unless the tree is under the node budget.
+ */
+struct TripleTree::LazySource {
+    const PNG *image;
+    const SummedAreaTable *table;
+    const MappedTripleTree *file; // nullptr, unless the tree was read from a file
+    double tol;
+    size_t pending;
+    bool budgeted;                // counted against the node budget, and never dropped
+    size_t nodes;                 // nodes the tree holds, if budgeted
+    TreeStats *stats;             // the tree's counters, for evictions made by other trees
+    unordered_set<Node*> evicted; // deep subtrees collapsed by the budget and not yet rebuilt
+    vector<uint64_t> path;        // file indices of the last node looked up and its ancestors
+};
+
+/**
+ * The node limit shared by budgeted trees. resident holds the expanded
+ * deep subtrees of every budgeted tree, most recently visited first, and
+ * index finds a subtree's place in it. Nothing is evicted while holds is
+ * nonzero.
+ */
+struct TripleTree::NodeBudget {
+    typedef list<pair<LazySource*, Node*>> Residents;
+    size_t limit;
+    size_t nodes;
+    size_t peak;          // most nodes held at once since the limit was set
+    unsigned int holds;
+    Residents resident;
+    unordered_map<Node*, Residents::iterator> index;
+};
+
+// a deep subtree, the unit of eviction, is a node of at most this many
+// pixels and more than a quarter as many; splits divide the area by 2 or
+// 3, so nearly every path from the root passes through one or two
+static const unsigned long EVICTION_PIXELS = 1024;
+
+static bool IsDeepSubtree(const Node* node) {
+    unsigned long pixels = (unsigned long) node->width * node->height;
+    return pixels <= EVICTION_PIXELS && pixels * 4 > EVICTION_PIXELS;
+}
 
  /**
       * Constructor that builds a TripleTree out of the given PNG.
@@ -13,7 +97,133 @@
       * @param imIn - the input image used to construct the tree
       */
 TripleTree::TripleTree(PNG& imIn) {
+	stats = TreeStats();
+	refinement = nullptr;
+	lazy = nullptr;
+	INSTRUMENT_TIMER(timer, stats.buildSeconds);
+	root = BuildNode(imIn, pair<unsigned int, unsigned int>(0, 0), imIn.width(), imIn.height());
+	INSTRUMENT(stats.maxDepth = height(root));
+}
+
+/**
+ * Constructor that builds the TripleTree that building from the PNG and
+ * then calling Prune(tol) would give, without creating the pruned nodes.
+ *
+ * @param imIn - the input image used to construct the tree
+ * @param tol - maximum allowable color distance to qualify for pruning
+ */
+TripleTree::TripleTree(PNG& imIn, double tol) {
+	stats = TreeStats();
+	refinement = nullptr;
+	lazy = nullptr;
+	INSTRUMENT_TIMER(timer, stats.buildSeconds);
+	root = BuildPruned(imIn, tol);
+	INSTRUMENT(stats.maxDepth = height(root));
+}
+
+/**
+ * Constructor that builds a TripleTree top-down from a summed-area table
+ * of the PNG, stopping at rectangles whose var is at most tol. The eager
+ * tree is a lazy one expanded right away.
+ *
+ * @param imIn - the input image, which table must have been built from
+ * @param table - summed-area table of imIn
+ * @param tol - maximum mean squared color distance of a leaf, or negative
+ * @param lazy - whether to build nodes on first access
+ */
+TripleTree::TripleTree(PNG& imIn, const SummedAreaTable& table, double tol, bool lazy) {
+	stats = TreeStats();
+	refinement = nullptr;
+	root = nullptr;
+	this->lazy = nullptr;
+	INSTRUMENT_TIMER(timer, stats.buildSeconds);
+	if (imIn.width() == 0 || imIn.height() == 0) {
+		return;
+	}
+	this->lazy = new LazySource{ &imIn, &table, nullptr, tol, 0, lazy && Budget().limit > 0, 0, &stats, {}, {} };
+	root = SummedNode(make_pair(0u, 0u), imIn.width(), imIn.height());
+	if (!lazy) {
+		ExpandAll();
+		INSTRUMENT(stats.maxDepth = height(root));
+	}
+}
+
+/**
+ * Constructor that reads a tree from a mapped file. The eager tree is a
+ * lazy one expanded right away.
+ *
+ * @param file - mapped tree file
+ * @param lazy - whether to build nodes on first access
+ */
+TripleTree::TripleTree(const MappedTripleTree& file, bool lazy) {
+	stats = TreeStats();
+	refinement = nullptr;
+	root = nullptr;
+	this->lazy = nullptr;
+	INSTRUMENT_TIMER(timer, stats.buildSeconds);
+	if (file.NodeCount() == 0) {
+		return;
+	}
+	this->lazy = new LazySource{ nullptr, nullptr, &file, 0, 0, lazy && Budget().limit > 0, 0, &stats, {}, {} };
+	root = FileNode(0);
+	if (!lazy) {
+		ExpandAll();
+		INSTRUMENT(stats.maxDepth = height(root));
+	}
+}
+
+/**
+ * Builds every node a lazy tree has not built yet, and takes it off the
+ * node budget.
+ */
+void TripleTree::Expand() {
+	Detach();
+}
+
+/**
+ * Sets the node limit for lazy trees built from now on, and evicts from
+ * the existing budgeted trees down to it.
+ *
+ * @param nodes - node limit, or 0 for none
+ */
+void TripleTree::SetNodeBudget(size_t nodes) {
+	Budget().limit = nodes;
+	EvictToBudget();
+	Budget().peak = Budget().nodes;
+}
+
+/**
+ * Returns the number of nodes budgeted trees hold.
+ */
+size_t TripleTree::BudgetedNodes() {
+	return Budget().nodes;
+}
+
+/**
+ * Returns the most nodes budgeted trees have held at once since the
+ * limit was last set.
+ */
+size_t TripleTree::PeakBudgetedNodes() {
+	return Budget().peak;
+}
+
+/**
+ * Constructor that decodes PNG file bytes held in memory and builds a
+ * TripleTree out of the decoded image. The tree is left empty if the
+ * bytes cannot be decoded.
+ */
+TripleTree::TripleTree(const unsigned char* data, size_t size) {
+	stats = TreeStats();
+	root = nullptr;
+	refinement = nullptr;
+	lazy = nullptr;
+	PNG imIn;
+	if (!imIn.decode(data, size)) {
+		return;
+	}
+	INSTRUMENT_TIMER(timer, stats.buildSeconds);
 	root = BuildNode(imIn, pair<unsigned int, unsigned int>(0, 0), imIn.width(), imIn.height());
+	INSTRUMENT(stats.maxDepth = height(root));
 }
 
 /**
@@ -38,6 +248,10 @@ TripleTree::~TripleTree() {
  * @param other - the TripleTree we are copying.
  */
 TripleTree::TripleTree(const TripleTree& other) {
+	stats = TreeStats();
+	refinement = nullptr;
+	lazy = nullptr;
+	INSTRUMENT_TIMER(timer, stats.copySeconds);
 	Copy(other);
 }
 
@@ -53,6 +267,7 @@ TripleTree& TripleTree::operator=(const TripleTree& rhs) {
 	// only take action if this object is not living at the same address as rhs
 	// i.e. this and rhs are physically different trees
 	if (this != &rhs) {
+		INSTRUMENT_TIMER(timer, stats.copySeconds);
 		// release any previously existing memory associated with this tree
 		Clear();
 		root = nullptr;
@@ -62,6 +277,72 @@ TripleTree& TripleTree::operator=(const TripleTree& rhs) {
 	return *this;
 }
 
+/**
+ * Move constructor for a TripleTree. No nodes are copied; other is left
+ * with no root.
+ *
+ * @param other - the TripleTree we are moving from.
+ */
+TripleTree::TripleTree(TripleTree&& other) noexcept {
+	root = other.root;
+	stats = other.stats;
+	refinement = other.refinement;
+	lazy = other.lazy;
+	other.root = nullptr;
+	other.stats = TreeStats();
+	queryStats.TakeFrom(other.queryStats);
+	other.refinement = nullptr;
+	other.lazy = nullptr;
+	if (lazy != nullptr) {
+		lazy->stats = &stats;
+	}
+}
+
+/**
+ * Move assignment operator for TripleTree. Frees this tree's nodes and
+ * takes over those of rhs.
+ *
+ * @param rhs - the right hand side of the assignment statement.
+ */
+TripleTree& TripleTree::operator=(TripleTree&& rhs) noexcept {
+	if (this != &rhs) {
+		Clear();
+		root = rhs.root;
+		stats = rhs.stats;
+		refinement = rhs.refinement;
+		lazy = rhs.lazy;
+		rhs.root = nullptr;
+		rhs.stats = TreeStats();
+		queryStats.TakeFrom(rhs.queryStats);
+		rhs.refinement = nullptr;
+		rhs.lazy = nullptr;
+		if (lazy != nullptr) {
+			lazy->stats = &stats;
+		}
+	}
+	return *this;
+}
+
+/**
+ * Exchanges the roots, statistics, collapsed subtrees and lazy sources of
+ * two trees.
+ *
+ * @param other - the TripleTree to swap with.
+ */
+void TripleTree::swap(TripleTree& other) noexcept {
+	std::swap(root, other.root);
+	std::swap(stats, other.stats);
+	queryStats.SwapWith(other.queryStats);
+	std::swap(refinement, other.refinement);
+	std::swap(lazy, other.lazy);
+	if (lazy != nullptr) {
+		lazy->stats = &stats;
+	}
+	if (other.lazy != nullptr) {
+		other.lazy->stats = &other.stats;
+	}
+}
+
 /**
  * Render returns a PNG image consisting of the pixels
  * stored in the tree. It may be used on pruned trees. Draws
@@ -71,25 +352,75 @@ TripleTree& TripleTree::operator=(const TripleTree& rhs) {
  * You may want a recursive helper function for this.
  */
 PNG TripleTree::Render() const {
-    // replace the line below with your implementation
+    INSTRUMENT_SHARED_TIMER(timer, queryStats.renderNanoseconds);
+    if (root == nullptr) {
+        return PNG();
+    }
     PNG png = PNG(root->width, root->height);
-    renderHelper(png, root);
+    if (lazy != nullptr && lazy->budgeted) {
+        trimmedWalk(numeric_limits<int>::max(), [&](Node* node, int) {
+            if (node->A == nullptr && node->B == nullptr && node->C == nullptr) {
+                fillHelper(png, node);
+            }
+        });
+    } else {
+        ExpandAll();
+        renderHelper(png, root);
+    }
+    Trim();
     return png;
 }
 
 /**
- * Prune function trims subtrees as high as possible in the tree.
- * A subtree is pruned (cleared) if all of its leaves are within
- * tol of the average color stored in the root of the subtree.
- * Pruning criteria should be evaluated on the original tree, not
- * on a pruned subtree. (we only expect that trees would be pruned once.)
+ * Prunes subtrees whose mean squared distance from their average color,
+ * kept in each node's var since the build, is at most tol.
  *
- * You may want a recursive helper function for this.
+ * @param tol - maximum mean squared color distance to qualify for pruning
+ */
+void TripleTree::PruneByVariance(double tol) {
+	INSTRUMENT_TIMER(timer, stats.pruneSeconds);
+	Detach();
+	if (refinement != nullptr) {
+		RefineTo(tol, &TripleTree::VarianceThreshold);
+		return;
+	}
+	root = PruneHelper(root, tol, [this](Node* subRoot, RGBAPixel avg, double tol, vector<Node*> &stack) {
+		return VarianceWithin(subRoot, avg, tol, stack);
+	});
+}
+
+/**
+ * Prunes the cheapest subtrees while the render's PSNR stays at or above
+ * targetPSNR. With incremental pruning on, the choice is made on the
+ * unpruned tree and becomes the collapsed set, as for any other prune.
  *
- * @param tol - maximum allowable RGBA color distance to qualify for pruning
+ * @param targetPSNR - lowest acceptable PSNR, in decibels
+ * @return the PSNR of the pruned tree, or infinity if it is exact
  */
-void TripleTree::Prune(double tol) {
-	root = PruneHelper(root, tol);
+double TripleTree::PruneToQuality(double targetPSNR) {
+	INSTRUMENT_TIMER(timer, stats.pruneSeconds);
+	Detach();
+	if (refinement != nullptr) {
+		Toggle(-1);
+	}
+	vector<Node*> collapsing;
+	double psnr = ChooseCollapses(targetPSNR, collapsing);
+	if (refinement != nullptr) {
+		// rank the highest chosen nodes below every other, and forget the criterion
+		RefineTo(-1, &TripleTree::VarianceThreshold);
+		for (Refinement::Entry& entry : refinement->entries) {
+			entry.threshold = binary_search(collapsing.begin(), collapsing.end(), entry.node) ? 0 : 1;
+		}
+		sort(refinement->entries.begin(), refinement->entries.end(),
+			[](const Refinement::Entry& x, const Refinement::Entry& y) { return x.threshold < y.threshold; });
+		refinement->threshold = nullptr;
+		Toggle(0);
+	} else {
+		root = PruneHelper(root, 0, [&collapsing](Node* subRoot, RGBAPixel, double, vector<Node*> &) {
+			return binary_search(collapsing.begin(), collapsing.end(), subRoot);
+		});
+	}
+	return psnr;
 }
 
 /**
@@ -100,6 +431,16 @@ void TripleTree::Prune(double tol) {
  * You may want a recursive helper function for this.
  */
 void TripleTree::FlipHorizontal() {
+    INSTRUMENT_TIMER(timer, stats.transformSeconds);
+    Detach();
+    if (refinement != nullptr) {
+        // flip the collapsed subtrees too, so that they can be expanded
+        double tol = refinement->tol;
+        Toggle(-1);
+        FlipHorizontalHelper(root);
+        Toggle(tol);
+        return;
+    }
     FlipHorizontalHelper(root);
 }
 
@@ -111,8 +452,17 @@ void TripleTree::FlipHorizontal() {
  * You may want a recursive helper function for this.
  */
 void TripleTree::RotateCCW() {
-    FlipHorizontalHelperRotate(root);
-	RotateCCWHelper(root);
+    INSTRUMENT_TIMER(timer, stats.transformSeconds);
+    Detach();
+    if (refinement != nullptr) {
+        // rotate the collapsed subtrees too, so that they can be expanded
+        double tol = refinement->tol;
+        Toggle(-1);
+        RotateCCWHelper(root);
+        Toggle(tol);
+        return;
+    }
+    RotateCCWHelper(root);
 }
 
 /**
@@ -120,504 +470,1994 @@ void TripleTree::RotateCCW() {
  *
  * You may want a recursive helper function for this.
  */
-int TripleTree::NumLeaves() const {
-    return leaves(root);
+uint64_t TripleTree::NumLeaves() const {
+    uint64_t count = 0;
+    if (lazy != nullptr && lazy->budgeted) {
+        trimmedWalk(numeric_limits<int>::max(), [&](Node* node, int) {
+            if (node->A == nullptr && node->B == nullptr && node->C == nullptr) {
+                count++;
+            }
+        });
+    } else {
+        ExpandAll();
+        count = leaves(root);
+    }
+    Trim();
+    return count;
 }
 
 /**
-     * Destroys all dynamically allocated memory associated with the
-     * current TripleTree object. To be completed for PA3.
-     * You may want a recursive helper function for this one.
-     */
-void TripleTree::Clear() {
-	clearHelper(root);
-    root = nullptr;
+ * Returns a snapshot of this tree's counters together with the
+ * process-wide PNG encode/decode counters.
+ */
+TreeStats TripleTree::Stats() const {
+    TreeStats snapshot = stats;
+    snapshot.pixelsFilled = queryStats.pixelsFilled.load(memory_order_relaxed);
+    snapshot.renderSeconds = queryStats.renderNanoseconds.load(memory_order_relaxed) / 1e9;
+    snapshot.nodesLive = liveNodes.load(memory_order_relaxed);
+    snapshot.io = ioStats();
+    return snapshot;
 }
 
 /**
- * Copies the parameter other TripleTree into the current TripleTree.
- * Does not free any memory. Called by copy constructor and operator=.
- * You may want a recursive helper function for this one.
- * @param other - The TripleTree to be copied.
+ * Sets this tree's counters back to zero.
  */
-void TripleTree::Copy(const TripleTree& other) {
-	root = CopyHelper(other.root);
+void TripleTree::ResetStats() {
+    stats = TreeStats();
+    queryStats.pixelsFilled = 0;
+    queryStats.renderNanoseconds = 0;
 }
 
 /**
- * Private helper function for the constructor. Recursively builds
- * the tree according to the specification of the constructor.
- * @param im - reference image used for construction
- * @param ul - upper left point of node to be built's rectangle.
- * @param w - width of node to be built's rectangle.
- * @param h - height of node to be built's rectangle.
+ * Writes Stats() to a stream as a single JSON object.
+ *
+ * @param out - stream to write to.
  */
-Node* TripleTree::BuildNode(PNG& im, pair<unsigned int, unsigned int> ul, unsigned int w, unsigned int h) {
-    Node *root = new Node(pair<unsigned int, unsigned int>(ul.first, ul.second), w, h);
-    Node *a, *b, *c;
-    // base case
-    if (w == 1 && h == 1) {
-        root->avg = (*im.getPixel(ul.first, ul.second));
-        return root;
-    }
-    // three case
-    if (w >= h) {
-        // two case first
-        if (w == 2) {
-            a = BuildNode(im, pair<unsigned int, unsigned int>(ul.first, ul.second), w / 2, h);
-            c = BuildNode(im, pair<unsigned int, unsigned int>(ul.first + 1, ul.second), w / 2, h);
-            root->avg = FindAverage(a, c);
-            root->A = a;
-            root->C = c;
-            return root;
-        }
-        int split = w % 3;
-        switch (split) {
-            case 0:
-                // equally divide
-                a = BuildNode(im, ul, w / 3, h);
-                b = BuildNode(im, pair<unsigned int, unsigned int>(ul.first + (w / 3), ul.second), w / 3, h);
-                c = BuildNode(im, pair<unsigned int, unsigned int>(ul.first + (2 * (w / 3)), ul.second), w / 3, h);
-                root->avg = FindAverage(a, b, c);
-                root->A = a;
-                root->B = b;
-                root->C = c;
-                return root;
-            case 1:
-                // B gets extra pixel
-                a = BuildNode(im, ul, w / 3, h);
-                b = BuildNode(im, pair<unsigned int, unsigned int>(ul.first + (w / 3), ul.second), (w / 3) + 1, h);
-                c = BuildNode(im, pair<unsigned int, unsigned int>(ul.first + (2 * (w / 3)) + 1, ul.second), w / 3, h);
-                root->avg = FindAverage(a, b, c);
-                root->A = a;
-                root->B = b;
-                root->C = c;
-                return root;
-            case 2:
-                // both A and C gets extra pixel
-                a = BuildNode(im, ul, (w / 3) + 1, h);
-                b = BuildNode(im, pair<unsigned int, unsigned int>(ul.first + (w / 3) + 1, ul.second), (w / 3), h);
-                c = BuildNode(im, pair<unsigned int, unsigned int>(ul.first + (2 * (w / 3)) + 1, ul.second), (w / 3) + 1, h);
-                root->avg = FindAverage(a, b, c);
-                root->A = a;
-                root->B = b;
-                root->C = c;
-                return root;
-            default:
-                return root;
-        }
-    } else {
-        // two case first
-        if (h == 2) {
-            a = BuildNode(im, pair<unsigned int, unsigned int>(ul.first, ul.second), w, h / 2);
-            c = BuildNode(im, pair<unsigned int, unsigned int>(ul.first, ul.second + 1), w, h / 2);
-            root->avg = FindAverage(a, c);
-            root->A = a;
-            root->C = c;
-            return root;
-        }
-        int split = h % 3;
-        switch (split) {
-            case 0:
-                // equally divide
-                a = BuildNode(im, ul, w, h / 3);
-                b = BuildNode(im, pair<unsigned int, unsigned int>(ul.first, ul.second + (h / 3)), w, h / 3);
-                c = BuildNode(im, pair<unsigned int, unsigned int>(ul.first, ul.second + 2 * (h / 3)), w, h / 3);
-                root->avg = FindAverage(a, b, c);
-                root->A = a;
-                root->B = b;
-                root->C = c;
-                return root;
-            case 1:
-                // B gets extra pixel
-                a = BuildNode(im, ul, w, h / 3);
-                b = BuildNode(im, pair<unsigned int, unsigned int>(ul.first, ul.second + (h / 3)), w, (h / 3) + 1);
-                c = BuildNode(im, pair<unsigned int, unsigned int>(ul.first, ul.second + (2 * (h / 3)) + 1), w, h / 3);
-                root->avg = FindAverage(a, b, c);
-                root->A = a;
-                root->B = b;
-                root->C = c;
-                return root;
-            case 2:
-                // both A and C gets extra pixel
-                a = BuildNode(im, ul, w, (h / 3) + 1);
-                b = BuildNode(im, pair<unsigned int, unsigned int>(ul.first, ul.second + (h / 3) + 1), w, (h / 3));
-                c = BuildNode(im, pair<unsigned int, unsigned int>(ul.first, ul.second + (2 * (h / 3)) + 1), w, (h / 3) + 1);
-                root->avg = FindAverage(a, b, c);
-                root->A = a;
-                root->B = b;
-                root->C = c;
-                return root;
-            default:
-                return root;
-        }
-    }
+void TripleTree::WriteStatsJSON(ostream& out) const {
+    TreeStats s = Stats();
+    out << "{\"nodes_allocated\": " << s.nodesAllocated
+        << ", \"nodes_cloned\": " << s.nodesCloned
+        << ", \"max_depth\": " << s.maxDepth
+        << ", \"prune_leaf_visits\": " << s.pruneLeafVisits
+        << ", \"distance_calls\": " << s.distanceCalls
+        << ", \"nodes_toggled\": " << s.nodesToggled
+        << ", \"nodes_expanded\": " << s.nodesExpanded
+        << ", \"subtrees_evicted\": " << s.subtreesEvicted
+        << ", \"nodes_evicted\": " << s.nodesEvicted
+        << ", \"subtrees_reexpanded\": " << s.subtreesReexpanded
+        << ", \"nodes_live\": " << s.nodesLive
+        << ", \"pixels_filled\": " << s.pixelsFilled
+        << ", \"build_seconds\": " << s.buildSeconds
+        << ", \"copy_seconds\": " << s.copySeconds
+        << ", \"prune_seconds\": " << s.pruneSeconds
+        << ", \"transform_seconds\": " << s.transformSeconds
+        << ", \"render_seconds\": " << s.renderSeconds
+        << ", \"png\": {\"decodes\": " << s.io.decodes
+        << ", \"encodes\": " << s.io.encodes
+        << ", \"bytes_read\": " << s.io.bytesRead
+        << ", \"bytes_inflated\": " << s.io.bytesInflated
+        << ", \"bytes_deflated\": " << s.io.bytesDeflated
+        << ", \"decode_seconds\": " << s.io.decodeSeconds
+        << ", \"encode_seconds\": " << s.io.encodeSeconds << "}}";
 }
 
 /**
- * Takes three nodes and returns the average of all three nodes (from the average of their leaf nodes
- * if nodes are not leaf nodes)
- * 
- * @param a - first node
- * @param b - second node
- * @param c - third node
+ * Writes the tree to a file in the flat, breadth-first layout that
+ * MappedTripleTree maps for read-only serving.
+ *
+ * @param fileName - name of the file to be written.
  */
-RGBAPixel TripleTree::FindAverage(Node *a, Node *b, Node *c) {
-    RGBAPixel avg; 
-
-    int a_pixels = a->width * a->height;
-    int b_pixels = b->width * b->height;
-    int c_pixels = c->width * c->height;
-
-    int total_pixels = a_pixels + b_pixels + c_pixels;
-
-    double avg_a = (a_pixels * a->avg.a + b_pixels * b->avg.a + c_pixels * c->avg.a) / total_pixels;
-    int avg_r = (a_pixels * a->avg.r + b_pixels * b->avg.r + c_pixels * c->avg.r) / total_pixels;
-    int avg_g = (a_pixels * a->avg.g + b_pixels * b->avg.g + c_pixels * c->avg.g) / total_pixels;
-    int avg_b = (a_pixels * a->avg.b + b_pixels * b->avg.b + c_pixels * c->avg.b) / total_pixels;
-    
-    if (avg_a < 0) {
-        avg.a = 0; 
-    } else if (avg_a > 1) {
-        avg.a = 1; 
-    } else {
-        avg.a = avg_a; 
-    }
-
-    if (avg_r < 0) {
-        avg.r = 0; 
-    } else if (avg_r > 255) {
-        avg.r = 255; 
-    } else {
-        avg.r = avg_r; 
+bool TripleTree::WriteToFile(const string& fileName) const {
+    // write beside the target and rename over it, so that a process that
+    // has the old file mapped keeps a complete tree instead of a torn one
+    static atomic<unsigned int> written(0);
+    string tempName = fileName + ".tmp" + to_string(getpid()) + "-" + to_string(written++);
+    ofstream out(tempName.c_str(), ios::binary | ios::trunc);
+    if (!out) {
+        cerr << "TripleTree: cannot write " << tempName << endl;
+        return false;
     }
-
-    if (avg_g < 0) {
-        avg.g = 0; 
-    } else if (avg_g > 255) {
-        avg.g = 255; 
-    } else {
-        avg.g = avg_g; 
+    bool ok = Write(out);
+    out.close();
+    if (!ok || !out) {
+        cerr << "TripleTree: error while writing " << tempName << endl;
+        remove(tempName.c_str());
+        return false;
     }
-
-    if (avg_b < 0) {
-        avg.b = 0; 
-    } else if (avg_b > 255) {
-        avg.b = 255; 
-    } else {
-        avg.b = avg_b; 
+    if (rename(tempName.c_str(), fileName.c_str()) != 0) {
+        cerr << "TripleTree: cannot replace " << fileName << endl;
+        remove(tempName.c_str());
+        return false;
     }
+    return true;
+}
 
-    return avg; 
+/**
+ * Converts a node to its flat form, without its child links.
+ *
+ * @param n - node to convert
+ */
+static FlatNode Flatten(const Node* n) {
+    FlatNode flat;
+    memset(&flat, 0, sizeof(flat));
+    flat.x = n->upperleft.first;
+    flat.y = n->upperleft.second;
+    flat.width = n->width;
+    flat.height = n->height;
+    flat.r = n->avg.r;
+    flat.g = n->avg.g;
+    flat.b = n->avg.b;
+    flat.a = n->avg.a;
+    flat.var = n->var;
+    return flat;
 }
 
 /**
- * Takes two nodes and returns the average of all two nodes (from the average of their leaf nodes
- * if nodes are not leaf nodes)
- * 
- * @param a - first node (based off triple tree structure)
- * @param c - third node (based off triple tree structure)
+ * Writes the tree to a stream in the flat, breadth-first layout. Nodes
+ * are numbered in the order they leave the queue, so each node's
+ * children receive the next free indices and end up contiguous. The
+ * order is collected first so that the header, which carries the node
+ * counts, can be written before any node.
+ *
+ * A tree under the node budget is instead counted level by level in one
+ * walk, then written one level per walk, each stopping at the level it
+ * writes. Depth-first order visits a level's nodes in breadth-first
+ * order, and every walk trims as it goes, so no level is held whole.
+ *
+ * @param out - stream to write to.
  */
-RGBAPixel TripleTree::FindAverage(Node *a, Node *c) {
-    RGBAPixel avg; 
-
-    int a_pixels = a->width * a->height;
-    int c_pixels = c->width * c->height;
-
-    int total_pixels = a_pixels + c_pixels;
-
-    double avg_a = (a_pixels * a->avg.a + c_pixels * c->avg.a) / total_pixels;
-    int avg_r = (a_pixels * a->avg.r + c_pixels * c->avg.r) / total_pixels;
-    int avg_g = (a_pixels * a->avg.g + c_pixels * c->avg.g) / total_pixels;
-    int avg_b = (a_pixels * a->avg.b + c_pixels * c->avg.b) / total_pixels;
-    
-    if (avg_a < 0) {
-        avg.a = 0; 
-    } else if (avg_a > 1) {
-        avg.a = 1; 
-    } else {
-        avg.a = avg_a; 
-    }
+bool TripleTree::Write(ostream& out) const {
+    FlatHeader header;
+    memcpy(header.magic, "TTRE", 4);
+    header.version = FLAT_VERSION;
+    header.leafCount = 0;
+    if (lazy != nullptr && lazy->budgeted) {
+        vector<uint64_t> levels; // nodes per level
+        if (root != nullptr) {
+            trimmedWalk(numeric_limits<int>::max(), [&](Node* node, int depth) {
+                if ((size_t) depth == levels.size()) {
+                    levels.push_back(0);
+                }
+                levels[depth]++;
+                if (node->A == nullptr && node->B == nullptr && node->C == nullptr) {
+                    header.leafCount++;
+                }
+            });
+        }
+        header.nodeCount = 0;
+        for (uint64_t count : levels) {
+            header.nodeCount += count;
+        }
+        out.write((const char*) &header, sizeof(header));
 
-    if (avg_r < 0) {
-        avg.r = 0; 
-    } else if (avg_r > 255) {
-        avg.r = 255; 
-    } else {
-        avg.r = avg_r; 
+        uint64_t next = 1; // index of the first child of the next internal node
+        for (int level = 0; (size_t) level < levels.size(); level++) {
+            trimmedWalk(level, [&](Node* node, int depth) {
+                if (depth < level) {
+                    return;
+                }
+                FlatNode flat = Flatten(node);
+                if (node->A != nullptr || node->B != nullptr || node->C != nullptr) {
+                    flat.firstChild = next;
+                    flat.numChildren = (node->B != nullptr) ? 3 : 2;
+                    next += flat.numChildren;
+                }
+                out.write((const char*) &flat, sizeof(flat));
+            });
+        }
+        Trim();
+        out.flush();
+        return (bool) out;
     }
 
-    if (avg_g < 0) {
-        avg.g = 0; 
-    } else if (avg_g > 255) {
-        avg.g = 255; 
-    } else {
-        avg.g = avg_g; 
+    ExpandAll();
+    vector<Node*> order;
+    if (root != nullptr) {
+        order.push_back(root);
     }
-
-    if (avg_b < 0) {
-        avg.b = 0; 
-    } else if (avg_b > 255) {
-        avg.b = 255; 
-    } else {
-        avg.b = avg_b; 
+    for (size_t i = 0; i < order.size(); i++) {
+        Node* n = order[i];
+        if (n->A == nullptr && n->B == nullptr && n->C == nullptr) {
+            header.leafCount++;
+        } else {
+            order.push_back(n->A);
+            if (n->B != nullptr) {
+                order.push_back(n->B);
+            }
+            order.push_back(n->C);
+        }
     }
+    header.nodeCount = order.size();
+    out.write((const char*) &header, sizeof(header));
 
-    return avg; 
+    uint64_t next = 1; // index of the first child of the next internal node
+    for (size_t i = 0; i < order.size(); i++) {
+        Node* n = order[i];
+        FlatNode flat = Flatten(n);
+        if (n->A != nullptr || n->B != nullptr || n->C != nullptr) {
+            flat.firstChild = next;
+            flat.numChildren = (n->B != nullptr) ? 3 : 2;
+            next += flat.numChildren;
+        }
+        out.write((const char*) &flat, sizeof(flat));
+    }
+    Trim();
+    out.flush();
+    return (bool) out;
 }
 
 /**
- * Helper function to calculate number of leaves in Triple Tree structure.
- * 
- * @param subRoot - root to count leaves
+ * Renders the tree as if every node at depth maxDepth were a leaf.
+ *
+ * @param maxDepth - deepest level of the tree to descend to.
  */
-int TripleTree::leaves(Node* subRoot) const {
-    if (subRoot->A == nullptr && subRoot->B == nullptr && subRoot->C == nullptr) {
-        return 1;
-    } else {
-        if (subRoot->B == nullptr) {
-            return leaves(subRoot->A) + leaves(subRoot->C);
-        } else {
-            return leaves(subRoot->A) + leaves(subRoot->B) + leaves(subRoot->C);
-        }
+PNG TripleTree::Render(int maxDepth) const {
+    INSTRUMENT_SHARED_TIMER(timer, queryStats.renderNanoseconds);
+    if (root == nullptr) {
+        return PNG();
     }
+    PNG png = PNG(root->width, root->height);
+    renderDepthHelper(png, root, maxDepth);
+    Trim();
+    return png;
 }
 
 /**
- * Helper function to render Triple Tree structure into a PNG.
- * 
- * @param img - reference to PNG structure
- * @param subRoot - pointer to node containing Triple Tree structure
+ * Renders the tree coarse-to-fine, one level at a time. Every level is
+ * painted over the previous one, so the work per level is proportional
+ * to the area still being refined rather than a fresh full render.
+ *
+ * @param emit - called with the depth just painted and the canvas.
  */
-void TripleTree::renderHelper(PNG &img, Node *subRoot) const {
-    if (subRoot->A == nullptr && subRoot->B == nullptr && subRoot->C == nullptr) {
-        for (unsigned int y = 0; y < subRoot->height; y++) {
-            for (unsigned int x = 0; x < subRoot->width; x++) {
-                RGBAPixel *t = img.getPixel(subRoot->upperleft.first + x, subRoot->upperleft.second + y);
-                *t = subRoot->avg;
+void TripleTree::RenderProgressive(function<void(int, const PNG&)> emit) const {
+    INSTRUMENT_SHARED_TIMER(timer, queryStats.renderNanoseconds);
+    if (root == nullptr) {
+        return;
+    }
+    PNG png = PNG(root->width, root->height);
+    vector<Node*> level;
+    level.push_back(root);
+    int depth = 0;
+    // emit may use other budgeted trees, whose evictions must not free
+    // the nodes held in level; other trees leave the budget alone, so
+    // they can render on several threads
+    bool hold = lazy != nullptr && lazy->budgeted;
+    if (hold) {
+        Budget().holds++;
+    }
+    while (!level.empty()) {
+        vector<Node*> next;
+        for (Node* n : level) {
+            fillHelper(png, n);
+            Reach(n);
+            if (n->A != nullptr) {
+                next.push_back(n->A);
+                if (n->B != nullptr) {
+                    next.push_back(n->B);
+                }
+                next.push_back(n->C);
             }
         }
-    } else {
-        renderHelper(img, subRoot->A);
-        if (subRoot->B != nullptr) {
-            renderHelper(img, subRoot->B);
-        }
-        renderHelper(img, subRoot->C);
+        emit(depth, png);
+        level.swap(next);
+        depth++;
     }
+    if (hold) {
+        Budget().holds--;
+    }
+    Trim();
 }
 
 /**
- * Helper function to copy one Triple Tree structure to another
- * 
- * @param other - pointer to Node containing Triple Tree structure
- */
-Node* TripleTree::CopyHelper(Node* other) {
-    Node *root = new Node(pair<unsigned int, unsigned int>(other->upperleft.first, other->upperleft.second), other->width, other->height);
-    root->avg = other->avg;
-    if (other->A != nullptr)
-        root->A = CopyHelper(other->A);
-    if (other->B != nullptr) 
-        root->B = CopyHelper(other->B);
-    if (other->C != nullptr)
-        root->C = CopyHelper(other->C);
-    return root;
-}
-
-/**
- * Helper function to deallocate and delete Triple Tree structure.
- * 
- * @param subRoot - pointer to Node containing Triple Tree structure
+ * Renders only the given viewport into a PNG of the viewport's size.
+ *
+ * @param x - left edge of the viewport.
+ * @param y - top edge of the viewport.
+ * @param w - width of the viewport in pixels.
+ * @param h - height of the viewport in pixels.
  */
-void TripleTree::clearHelper(Node* subRoot) {
-    if (subRoot->A == nullptr && subRoot->B == nullptr && subRoot->C == nullptr) {
-        delete subRoot;
-    } else {
-        clearHelper(subRoot->A);
-        subRoot->A = nullptr;
-        if (subRoot->B != nullptr) {
-            clearHelper(subRoot->B);
-            subRoot->B = nullptr;
-        }
-        clearHelper(subRoot->C);
-        subRoot->C = nullptr;
-        clearHelper(subRoot);
+PNG TripleTree::RenderRegion(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const {
+    INSTRUMENT_SHARED_TIMER(timer, queryStats.renderNanoseconds);
+    PNG png = PNG(w, h);
+    if (root != nullptr && w > 0 && h > 0) {
+        regionHelper(png, root, x, y);
     }
+    Trim();
+    return png;
 }
 
-
-Node* TripleTree::FlipHorizontalHelper(Node*& subRoot) {
-    if (subRoot == NULL) {
-        return NULL;
-    }
-
-    if (subRoot->A == NULL && subRoot->B == NULL && subRoot->C == NULL) {
-        return subRoot;
+/**
+ * Renders the tree at an arbitrary output resolution.
+ *
+ * @param outWidth - width of the rendered image in pixels.
+ * @param outHeight - height of the rendered image in pixels.
+ */
+PNG TripleTree::Render(unsigned int outWidth, unsigned int outHeight) const {
+    INSTRUMENT_SHARED_TIMER(timer, queryStats.renderNanoseconds);
+    PNG png = PNG(outWidth, outHeight);
+    if (root == nullptr || outWidth == 0 || outHeight == 0) {
+        return png;
     }
+    // per output pixel: weighted sums of r, g, b, a and the total weight
+    vector<double> acc((size_t) outWidth * outHeight * 5, 0.0);
+    double sx = (double) outWidth / root->width;
+    double sy = (double) outHeight / root->height;
+    scaledHelper(acc, root, outWidth, outHeight, sx, sy);
+    Trim();
 
-    if (subRoot->height > subRoot->width) {
-        FlipHorizontalHelper(subRoot->A); 
-        FlipHorizontalHelper(subRoot->B);
-        FlipHorizontalHelper(subRoot->C);
-        return subRoot; 
-    } else { // width >= height
-        FlipHorizontalHelper(subRoot->A); 
-        FlipHorizontalHelper(subRoot->B);
-        FlipHorizontalHelper(subRoot->C);
-
-        unsigned int difference = abs((double) subRoot->A->upperleft.first - subRoot->C->upperleft.first);
-
-        if (subRoot->A->upperleft.first > subRoot->C->upperleft.first) {
-            MoveToLeft(subRoot->A, difference);
-            MoveToRight(subRoot->C, difference);
-        } else {
-            MoveToRight(subRoot->A, difference);
-            MoveToLeft(subRoot->C, difference);
+    for (unsigned int y = 0; y < outHeight; y++) {
+        RGBAPixel *row = png.getPixel(0, y);
+        for (unsigned int x = 0; x < outWidth; x++) {
+            double *p = &acc[((size_t) y * outWidth + x) * 5];
+            if (p[4] > 0) {
+                row[x].r = (unsigned char) min(255.0, p[0] / p[4] + 0.5);
+                row[x].g = (unsigned char) min(255.0, p[1] / p[4] + 0.5);
+                row[x].b = (unsigned char) min(255.0, p[2] / p[4] + 0.5);
+                row[x].a = min(1.0, p[3] / p[4]);
+            }
         }
-
-        swap(subRoot->A, subRoot->C); 
-        return subRoot;
     }
+    return png;
 }
 
-Node* TripleTree::MoveToRight(Node*& subRoot, unsigned int x) {
-    if (subRoot == NULL) {
-        return NULL;
+/**
+ * Returns the color that Render() would give pixel (x, y).
+ *
+ * @param x - horizontal coordinate of the pixel.
+ * @param y - vertical coordinate of the pixel.
+ */
+RGBAPixel TripleTree::ColorAt(unsigned int x, unsigned int y) const {
+    Node* n = root;
+    if (n == nullptr || x - n->upperleft.first >= n->width || y - n->upperleft.second >= n->height) {
+        return RGBAPixel();
     }
-    if (subRoot->A == NULL && subRoot->B == NULL && subRoot->C == NULL) {
-        subRoot->upperleft.first += x;
-        return subRoot;
-    } else {
-        subRoot->upperleft.first += x;
-        MoveToRight(subRoot->A, x);
-        MoveToRight(subRoot->B, x); 
-        MoveToRight(subRoot->C, x); 
-        return subRoot;
+    Reach(n);
+    while (n->A != nullptr || n->B != nullptr || n->C != nullptr) {
+        // after a flip or rotation A is not necessarily the upper-left child,
+        // so test each child's rectangle instead of recomputing the split
+        Node* children[3] = { n->A, n->B, n->C };
+        Node* next = nullptr;
+        for (Node* c : children) {
+            if (c != nullptr && x - c->upperleft.first < c->width && y - c->upperleft.second < c->height) {
+                next = c;
+                break;
+            }
+        }
+        if (next == nullptr) {
+            break;
+        }
+        n = next;
+        Reach(n);
     }
+    RGBAPixel color = n->avg;
+    Trim();
+    return color;
 }
 
-// important: x must be <= subRoot->upperleft.first for subRoot and its children
-Node* TripleTree::MoveToLeft(Node*& subRoot, unsigned int x) {
-    if (subRoot == NULL) {
-        return NULL;
+/**
+ * Returns the area-weighted average color over a rectangle of the image.
+ *
+ * @param x - left edge of the rectangle.
+ * @param y - top edge of the rectangle.
+ * @param w - width of the rectangle in pixels.
+ * @param h - height of the rectangle in pixels.
+ */
+RGBAPixel TripleTree::AverageOver(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const {
+    // weighted sums of r, g, b, a and the total weight
+    double sum[5] = { 0, 0, 0, 0, 0 };
+    if (root != nullptr) {
+        averageHelper(sum, root, x, y, w, h);
     }
-    if (subRoot->A == NULL && subRoot->B == NULL && subRoot->C == NULL) {
-        subRoot->upperleft.first += -x;
-        return subRoot;
-    } else {
-        subRoot->upperleft.first += -x;
-        MoveToLeft(subRoot->A, x);
-        MoveToLeft(subRoot->B, x); 
-        MoveToLeft(subRoot->C, x);
-        return subRoot;
+    Trim();
+    RGBAPixel avg;
+    if (sum[4] > 0) {
+        avg.r = (unsigned char) min(255.0, sum[0] / sum[4] + 0.5);
+        avg.g = (unsigned char) min(255.0, sum[1] / sum[4] + 0.5);
+        avg.b = (unsigned char) min(255.0, sum[2] / sum[4] + 0.5);
+        avg.a = min(1.0, sum[3] / sum[4]);
     }
+    return avg;
 }
 
-Node* TripleTree::RotateCCWHelper(Node*& subRoot) {
-    if (subRoot == NULL) {
-        return NULL;
-    }
-    if (subRoot->A == NULL && subRoot->B == NULL && subRoot->C == NULL) {
-        swap(subRoot->upperleft.first, subRoot->upperleft.second);
-        swap(subRoot->width, subRoot->height);
-        return subRoot; 
-    } else if (subRoot->width >= subRoot->height) { // wide or square case
-        swap(subRoot->upperleft.first, subRoot->upperleft.second);
-        swap(subRoot->width, subRoot->height);
-        // swap(subRoot->A, subRoot->C); // new place
-        RotateCCWHelper(subRoot->A);
-        RotateCCWHelper(subRoot->B);
-        RotateCCWHelper(subRoot->C); 
-        swap(subRoot->A, subRoot->C); // original place 
-    } else { // tall case
-        swap(subRoot->upperleft.first, subRoot->upperleft.second);
-        swap(subRoot->width, subRoot->height);
-        RotateCCWHelper(subRoot->A);
-        RotateCCWHelper(subRoot->B);
-        RotateCCWHelper(subRoot->C);
-    }
-    return subRoot;
+/**
+     * Destroys all dynamically allocated memory associated with the
+     * current TripleTree object. To be completed for PA3.
+     * You may want a recursive helper function for this one.
+     */
+void TripleTree::Clear() {
+	SetIncrementalPrune(false);
+	clearHelper(root);
+    root = nullptr;
+    ReleaseSource(lazy);
+    lazy = nullptr;
 }
 
 /**
- * Helper function to prune the Triple Tree structure.
- * 
- * @param subRoot - pointer to Node containing Triple Tree structure
- * @param tol - number corresponding to distanceTo function which will determine which nodes to prune
+ * Copies the parameter other TripleTree into the current TripleTree.
+ * Does not free any memory. Called by copy constructor and operator=.
+ * The nodes themselves are shared, and only cloned when either tree
+ * modifies them.
+ * @param other - The TripleTree to be copied.
  */
-Node* TripleTree::PruneHelper(Node* subRoot, double tol) {
-    if (subRoot == nullptr) return nullptr;
-    if (subRoot->A == nullptr && subRoot->B == nullptr && subRoot->C == nullptr) return subRoot;
-    if (ShouldPrune(subRoot, subRoot->avg, tol)) {
-        clearHelper(subRoot->A);
-        subRoot->A = nullptr;
-        if (subRoot->B != nullptr) {
-            clearHelper(subRoot->B);
-            subRoot->B = nullptr;
-        }
-        clearHelper(subRoot->C);
-        subRoot->C = nullptr;
-    } else {
-        subRoot->A = PruneHelper(subRoot->A, tol);
-        if (subRoot->B != nullptr)
-            subRoot->B = PruneHelper(subRoot->B, tol);
-        subRoot->C =PruneHelper(subRoot->C, tol);
-    }
-    return subRoot;
+void TripleTree::Copy(const TripleTree& other) {
+	// shared nodes must be complete, since building children changes a node
+	other.ExpandAll();
+	if (other.refinement != nullptr || other.lazy != nullptr) {
+		// other changes its nodes in place, so they cannot be shared
+		root = DeepCopy(other.root);
+		return;
+	}
+	root = other.root;
+	if (root != nullptr) {
+		root->refs++;
+	}
 }
 
 /**
- * Helper function to determine whether Node should be pruned based of tolerance
- * and leaves.
- * 
- * @param other - pointer to Node containing Triple Tree structure
- * @param avg - pixel to compare to
- * @param tol - number corresponding to distanceTo function which will determine which nodes to prune
+ * Per-channel sums and sums of squares of a subimage's pixels; red, green
+ * and blue are summed exactly as integers.
  */
-bool TripleTree::ShouldPrune(Node* subRoot, RGBAPixel avg, double tol) {
-    if (subRoot->A == nullptr && subRoot->B == nullptr && subRoot->C == nullptr) {
-        // leaf node
-        if (subRoot->avg.distanceTo(avg) <= tol) {
-            return true;
-        } else {
-            return false;
+struct Moments {
+    uint64_t sum[3];
+    uint64_t sumsq[3];
+    double alpha;
+    double alphasq;
+
+    explicit Moments(const RegionSums& s) {
+        for (int i = 0; i < 3; i++) {
+            sum[i] = s.sum[i];
+            sumsq[i] = s.sumsq[i];
+        }
+        alpha = s.alpha;
+        alphasq = s.alphasq;
+    }
+
+    explicit Moments(const RGBAPixel& p) {
+        sum[0] = p.r; sum[1] = p.g; sum[2] = p.b;
+        sumsq[0] = p.r * p.r; sumsq[1] = p.g * p.g; sumsq[2] = p.b * p.b;
+        alpha = p.a;
+        alphasq = p.a * p.a;
+    }
+
+    void Add(const Moments& other) {
+        for (int i = 0; i < 3; i++) {
+            sum[i] += other.sum[i];
+            sumsq[i] += other.sumsq[i];
+        }
+        alpha += other.alpha;
+        alphasq += other.alphasq;
+    }
+};
+
+/**
+ * An average color and the number of pixels it covers, the part of a node
+ * that FindAverage reads.
+ */
+struct Weighted {
+    uint64_t pixels;
+    int r, g, b;
+    double a;
+};
+
+/**
+ * The average of count weighted colors, each channel truncated and
+ * clamped to its range.
+ */
+static Weighted Combine(const Weighted *parts, int count) {
+    Weighted avg = { 0, 0, 0, 0, 0 };
+    double sum_a = 0;
+    // 64 bits, as 255 times the pixels of an image over 8 MP overflows an int
+    uint64_t sum_r = 0, sum_g = 0, sum_b = 0;
+    for (int i = 0; i < count; i++) {
+        avg.pixels += parts[i].pixels;
+        sum_a += parts[i].pixels * parts[i].a;
+        sum_r += parts[i].pixels * parts[i].r;
+        sum_g += parts[i].pixels * parts[i].g;
+        sum_b += parts[i].pixels * parts[i].b;
+    }
+    avg.a = min(max(sum_a / avg.pixels, 0.0), 1.0);
+    avg.r = (int) min(sum_r / avg.pixels, (uint64_t) 255);
+    avg.g = (int) min(sum_g / avg.pixels, (uint64_t) 255);
+    avg.b = (int) min(sum_b / avg.pixels, (uint64_t) 255);
+    return avg;
+}
+
+static inline Weighted Weigh(const Node *node) {
+    return Weighted{ (uint64_t) node->width * node->height, node->avg.r, node->avg.g, node->avg.b, node->avg.a };
+}
+
+static inline Weighted Weigh(const RGBAPixel &pixel) {
+    return Weighted{ 1, pixel.r, pixel.g, pixel.b, pixel.a };
+}
+
+/**
+ * The mean squared distance of n pixels from avg, given their moments.
+ */
+static float Variance(const Weighted &avg, const Moments &total) {
+    // sum of (x - avg)^2 over the pixels, for each channel
+    double n = avg.pixels;
+    int channels[3] = { avg.r, avg.g, avg.b };
+    double error = 0;
+    for (int i = 0; i < 3; i++) {
+        error += (double) total.sumsq[i] - 2.0 * channels[i] * total.sum[i] + n * channels[i] * channels[i];
+    }
+    error *= 1 / (255.0 * 255.0);
+    error += total.alphasq - 2 * avg.a * total.alpha + n * avg.a * avg.a;
+    return (float) max(0.0, error / n);
+}
+
+/**
+ * Sets a node's var from the moments of its pixels.
+ */
+static void SetVariance(Node *node, const Moments &total) {
+    node->var = Variance(Weigh(node), total);
+}
+
+/**
+ * Replaces the moments of a node's children, the last count entries of
+ * moments, by the node's own, and returns them.
+ */
+static const Moments& MergeMoments(vector<Moments> &moments, int count) {
+    size_t first = moments.size() - count;
+    Moments &total = moments[first];
+    for (size_t k = first + 1; k < moments.size(); k++) {
+        total.Add(moments[k]);
+    }
+    moments.erase(moments.begin() + first + 1, moments.end());
+    return total;
+}
+
+/**
+ * Replaces the moments of a node's children by the node's own, and sets
+ * its var from them.
+ */
+static void FinishMoments(Node *node, vector<Moments> &moments, int count) {
+    SetVariance(node, MergeMoments(moments, count));
+}
+
+/**
+ * Splits a rectangle along its longer side, the wide case winning ties.
+ *
+ * @param w - width of the rectangle, more than 1 pixel in total
+ * @param h - height of the rectangle
+ * @param sizes - set to the lengths of A, B and C along the split; B's is 0
+ *                when the side is 2 pixels long
+ * @return whether the rectangle is split left to right
+ */
+static bool SplitSizes(unsigned int w, unsigned int h, unsigned int sizes[3]) {
+    bool wide = w >= h;
+    unsigned int length = wide ? w : h;
+    unsigned int third = length / 3;
+    if (length == 2) {
+        // two case
+        sizes[0] = 1; sizes[1] = 0; sizes[2] = 1;
+    } else if (length % 3 == 0) {
+        // equally divide
+        sizes[0] = third; sizes[1] = third; sizes[2] = third;
+    } else if (length % 3 == 1) {
+        // B gets extra pixel
+        sizes[0] = third; sizes[1] = third + 1; sizes[2] = third;
+    } else {
+        // both A and C gets extra pixel
+        sizes[0] = third + 1; sizes[1] = third; sizes[2] = third + 1;
+    }
+    return wide;
+}
+
+/**
+ * Private helper function for the constructor. Builds the tree according
+ * to the specification of the constructor without recursing. Rectangles
+ * wait on an explicit stack and are allocated in the same order as a
+ * recursive build; each split node also leaves a marker below its
+ * children, so that its average is combined once they are complete.
+ * @param im - reference image used for construction
+ * @param ul - upper left point of node to be built's rectangle.
+ * @param w - width of node to be built's rectangle.
+ * @param h - height of node to be built's rectangle.
+ */
+Node* TripleTree::BuildNode(PNG& im, pair<unsigned int, unsigned int> ul, unsigned int w, unsigned int h) {
+    struct Frame {
+        Node *done;   // split node whose children are complete, or nullptr
+        Node **slot;  // where to store the node built for this rectangle
+        pair<unsigned int, unsigned int> ul;
+        unsigned int w, h;
+    };
+    Node *root = nullptr;
+    vector<Frame> stack;
+    // sums and sums of squares of the pixels of each completed subtree whose
+    // parent is not done yet; nodes complete in post-order, so a node's
+    // children are the last entries when it is done
+    vector<Moments> moments;
+    stack.push_back(Frame{ nullptr, &root, ul, w, h });
+    while (!stack.empty()) {
+        Frame frame = stack.back();
+        stack.pop_back();
+        if (frame.done != nullptr) {
+            Node *node = frame.done;
+            node->avg = (node->B != nullptr) ? FindAverage(node->A, node->B, node->C) : FindAverage(node->A, node->C);
+            FinishMoments(node, moments, (node->B != nullptr) ? 3 : 2);
+            continue;
+        }
+
+        Node *node = new Node(frame.ul, frame.w, frame.h);
+        INSTRUMENT(stats.nodesAllocated++; liveNodes++);
+        *frame.slot = node;
+        // base case
+        if (frame.w == 1 && frame.h == 1) {
+            node->avg = (*im.getPixel(frame.ul.first, frame.ul.second));
+            moments.push_back(Moments(node->avg));
+            continue;
+        }
+
+        unsigned int sizes[3];
+        bool wide = SplitSizes(frame.w, frame.h, sizes);
+        unsigned int offsets[3] = { 0, sizes[0], sizes[0] + sizes[1] };
+        Node **slots[3] = { &node->A, &node->B, &node->C };
+
+        if ((uint64_t) frame.w * frame.h <= 3) {
+            // every child is a single pixel, finish the node right away
+            Moments total(*im.getPixel(frame.ul.first, frame.ul.second));
+            for (int i = 0; i < 3; i++) {
+                if (sizes[i] == 0) {
+                    continue;
+                }
+                pair<unsigned int, unsigned int> cul = wide ? make_pair(frame.ul.first + offsets[i], frame.ul.second)
+                                                            : make_pair(frame.ul.first, frame.ul.second + offsets[i]);
+                Node *child = new Node(cul, 1, 1);
+                INSTRUMENT(stats.nodesAllocated++; liveNodes++);
+                child->avg = (*im.getPixel(cul.first, cul.second));
+                if (i > 0) {
+                    total.Add(Moments(child->avg));
+                }
+                *slots[i] = child;
+            }
+            node->avg = (node->B != nullptr) ? FindAverage(node->A, node->B, node->C) : FindAverage(node->A, node->C);
+            SetVariance(node, total);
+            moments.push_back(total);
+            continue;
+        }
+
+        stack.push_back(Frame{ node, nullptr, frame.ul, 0, 0 });
+        // C is pushed first so that A is built first
+        for (int i = 2; i >= 0; i--) {
+            if (sizes[i] == 0) {
+                continue;
+            }
+            if (wide) {
+                stack.push_back(Frame{ nullptr, slots[i],
+                    make_pair(frame.ul.first + offsets[i], frame.ul.second), sizes[i], frame.h });
+            } else {
+                stack.push_back(Frame{ nullptr, slots[i],
+                    make_pair(frame.ul.first, frame.ul.second + offsets[i]), frame.w, sizes[i] });
+            }
+        }
+    }
+    return root;
+}
+
+/**
+ * Private helper function for the pruning constructor. The average of a
+ * split node depends on its children's averages, which are rounded, so
+ * every node's average and var are first computed as BuildNode would,
+ * into a compact array in pre-order, with nodes that only live on the
+ * stack. The tree is then built top-down: a rectangle whose pixels are
+ * all within tol of its average becomes a leaf, exactly where
+ * PruneHelper would prune, and is not split any further.
+ *
+ * @param im - reference image used for construction
+ * @param tol - maximum allowable color distance to qualify for pruning
+ */
+Node* TripleTree::BuildPruned(PNG& im, double tol) {
+    struct Summary {
+        Weighted avg;
+        float var;
+        size_t next;  // index of the first split node after this subtree
+    };
+    struct Frame {
+        int64_t done; // index of a split node whose children are complete, or -1
+        bool middle;  // for a done node, whether it has a B child
+        pair<unsigned int, unsigned int> ul;
+        unsigned int w, h;
+    };
+    if (im.width() == 0 || im.height() == 0) {
+        return nullptr;
+    }
+    vector<Summary> summaries;
+    vector<Frame> stack;
+    // averages and moments of the completed subtrees whose parent is not
+    // done yet, as in BuildNode
+    vector<Weighted> averages;
+    vector<Moments> moments;
+    stack.push_back(Frame{ -1, false, make_pair(0u, 0u), im.width(), im.height() });
+    while (!stack.empty()) {
+        Frame frame = stack.back();
+        stack.pop_back();
+        if (frame.done >= 0) {
+            int count = frame.middle ? 3 : 2;
+            Weighted avg = Combine(&averages[averages.size() - count], count);
+            averages.erase(averages.end() - count, averages.end());
+            averages.push_back(avg);
+            summaries[frame.done] = Summary{ avg, Variance(avg, MergeMoments(moments, count)), summaries.size() };
+            continue;
+        }
+
+        if (frame.w == 1 && frame.h == 1) {
+            const RGBAPixel &pixel = *im.getPixel(frame.ul.first, frame.ul.second);
+            averages.push_back(Weigh(pixel));
+            moments.push_back(Moments(pixel));
+            continue;
+        }
+
+        unsigned int sizes[3];
+        bool wide = SplitSizes(frame.w, frame.h, sizes);
+        unsigned int offsets[3] = { 0, sizes[0], sizes[0] + sizes[1] };
+        int64_t index = summaries.size();
+        summaries.push_back(Summary());
+
+        if ((uint64_t) frame.w * frame.h <= 3) {
+            // every child is a single pixel, finish the node right away
+            Weighted pixels[3];
+            int count = 0;
+            Moments total(*im.getPixel(frame.ul.first, frame.ul.second));
+            for (int i = 0; i < 3; i++) {
+                if (sizes[i] == 0) {
+                    continue;
+                }
+                const RGBAPixel &pixel = wide ? *im.getPixel(frame.ul.first + offsets[i], frame.ul.second)
+                                              : *im.getPixel(frame.ul.first, frame.ul.second + offsets[i]);
+                pixels[count++] = Weigh(pixel);
+                if (i > 0) {
+                    total.Add(Moments(pixel));
+                }
+            }
+            Weighted avg = Combine(pixels, count);
+            averages.push_back(avg);
+            moments.push_back(total);
+            summaries[index] = Summary{ avg, Variance(avg, total), summaries.size() };
+            continue;
+        }
+
+        stack.push_back(Frame{ index, sizes[1] != 0, frame.ul, frame.w, frame.h });
+        // C is pushed first so that A is summarized first
+        for (int i = 2; i >= 0; i--) {
+            if (sizes[i] == 0) {
+                continue;
+            }
+            if (wide) {
+                stack.push_back(Frame{ -1, false, make_pair(frame.ul.first + offsets[i], frame.ul.second), sizes[i], frame.h });
+            } else {
+                stack.push_back(Frame{ -1, false, make_pair(frame.ul.first, frame.ul.second + offsets[i]), frame.w, sizes[i] });
+            }
+        }
+    }
+
+    struct Visit {
+        Node **slot;
+        size_t index; // index of the rectangle's summary, if it is split
+        pair<unsigned int, unsigned int> ul;
+        unsigned int w, h;
+    };
+    Node *built = nullptr;
+    vector<Visit> visits(1, Visit{ &built, 0, make_pair(0u, 0u), im.width(), im.height() });
+    while (!visits.empty()) {
+        Visit visit = visits.back();
+        visits.pop_back();
+        Node *node = new Node(visit.ul, visit.w, visit.h);
+        INSTRUMENT(stats.nodesAllocated++; liveNodes++);
+        *visit.slot = node;
+        if (visit.w == 1 && visit.h == 1) {
+            node->avg = *im.getPixel(visit.ul.first, visit.ul.second);
+            continue;
+        }
+        const Summary &summary = summaries[visit.index];
+        node->avg = RGBAPixel(summary.avg.r, summary.avg.g, summary.avg.b, summary.avg.a);
+        node->var = summary.var;
+
+        // the leaves PruneHelper would test are the rectangle's pixels
+        RGBADistance::Color reference = RGBADistance::Convert(node->avg);
+        bool prune = true;
+        for (unsigned int y = visit.ul.second; prune && y < visit.ul.second + visit.h; y++) {
+            RGBAPixel *row = im.getPixel(visit.ul.first, y);
+            for (unsigned int x = 0; x < visit.w; x++) {
+                INSTRUMENT(stats.pruneLeafVisits++; stats.distanceCalls++);
+                if (RGBADistance::Distance(RGBADistance::Convert(row[x]), reference) > tol) {
+                    prune = false;
+                    break;
+                }
+            }
+        }
+        if (prune) {
+            continue;
+        }
+
+        unsigned int sizes[3];
+        bool wide = SplitSizes(visit.w, visit.h, sizes);
+        Node **slots[3] = { &node->A, &node->B, &node->C };
+        Visit split[3];
+        unsigned int offset = 0;
+        size_t index = visit.index + 1;
+        for (int i = 0; i < 3; i++) {
+            split[i] = wide ? Visit{ slots[i], index, make_pair(visit.ul.first + offset, visit.ul.second), sizes[i], visit.h }
+                            : Visit{ slots[i], index, make_pair(visit.ul.first, visit.ul.second + offset), visit.w, sizes[i] };
+            offset += sizes[i];
+            if (sizes[i] != 0 && (uint64_t) split[i].w * split[i].h > 1) {
+                index = summaries[index].next;
+            }
+        }
+        // C is pushed first so that A is built first
+        for (int i = 2; i >= 0; i--) {
+            if (sizes[i] != 0) {
+                visits.push_back(split[i]);
+            }
+        }
+    }
+    return built;
+}
+
+/**
+ * Creates the node of a rectangle of a summed-area tree, with its average
+ * and var from four table lookups, or the pixel itself. A node that is
+ * to be split is left without children, its var negated, until
+ * ExpandNode builds them.
+ *
+ * @param ul - upper left point of the rectangle
+ * @param w - width of the rectangle
+ * @param h - height of the rectangle
+ */
+Node* TripleTree::SummedNode(pair<unsigned int, unsigned int> ul, unsigned int w, unsigned int h) const {
+    Node *node = LazyNode(ul, w, h);
+    if (w == 1 && h == 1) {
+        node->avg = *lazy->image->getPixel(ul.first, ul.second);
+        return node;
+    }
+    RegionSums sums = lazy->table->Sums(ul.first, ul.second, w, h);
+    uint64_t n = (uint64_t) w * h;
+    Weighted avg = { n, (int) (sums.sum[0] / n), (int) (sums.sum[1] / n), (int) (sums.sum[2] / n),
+                     min(max(sums.alpha / n, 0.0), 1.0) };
+    node->avg = RGBAPixel(avg.r, avg.g, avg.b, avg.a);
+    node->var = Variance(avg, Moments(sums));
+    if (node->var > lazy->tol) {
+        node->var = -node->var;
+        lazy->pending++;
+    }
+    return node;
+}
+
+/**
+ * Allocates a node of a lazy tree, counting it against the node budget
+ * if the tree is budgeted.
+ *
+ * @param ul - upper left point of the rectangle
+ * @param w - width of the rectangle
+ * @param h - height of the rectangle
+ */
+Node* TripleTree::LazyNode(pair<unsigned int, unsigned int> ul, unsigned int w, unsigned int h) const {
+    Node *node = new Node(ul, w, h);
+    INSTRUMENT(stats.nodesAllocated++; liveNodes++);
+    if (lazy->budgeted) {
+        lazy->nodes++;
+        NodeBudget &budget = Budget();
+        if (++budget.nodes > budget.peak) {
+            budget.peak = budget.nodes;
+        }
+    }
+    return node;
+}
+
+/**
+ * Returns the number of children of a node of a mapped file that are
+ * available and stored after it, 0 for a leaf or a damaged node.
+ */
+static unsigned int FileChildren(const MappedTripleTree& file, uint64_t index) {
+    const FlatNode &flat = file.NodeAt(index);
+    if ((flat.numChildren != 2 && flat.numChildren != 3) || flat.firstChild <= index
+            || flat.firstChild + flat.numChildren > file.NodeCount()) {
+        return 0;
+    }
+    return flat.numChildren;
+}
+
+static bool Contains(const FlatNode& flat, const Node* node) {
+    return flat.x <= node->upperleft.first && flat.y <= node->upperleft.second
+        && (uint64_t) node->upperleft.first + node->width <= (uint64_t) flat.x + flat.width
+        && (uint64_t) node->upperleft.second + node->height <= (uint64_t) flat.y + flat.height;
+}
+
+/**
+ * Creates the node of a tree read from a mapped file from the file's
+ * node at index. A node with children is left without them, its var
+ * negated, until ExpandNode builds them.
+ *
+ * @param index - breadth-first index of the node in the file
+ */
+Node* TripleTree::FileNode(uint64_t index) const {
+    const FlatNode &flat = lazy->file->NodeAt(index);
+    Node *node = LazyNode(make_pair(flat.x, flat.y), flat.width, flat.height);
+    node->avg = RGBAPixel(flat.r, flat.g, flat.b, flat.a);
+    node->var = fabs(flat.var);
+    if (FileChildren(*lazy->file, index) > 0) {
+        node->var = -node->var;
+        lazy->pending++;
+    }
+    return node;
+}
+
+/**
+ * Finds the file index of a node of a tree read from a mapped file. The
+ * walk starts from the last node looked up, or its nearest ancestor
+ * that contains node, and since nodes are mostly expanded in the order
+ * a walk of the tree reaches them, it usually takes one step.
+ *
+ * @param node - node of this tree
+ * @param index - set to the node's index in the file
+ * @return false, if a damaged file has no node with node's rectangle.
+ */
+bool TripleTree::FileIndex(const Node* node, uint64_t& index) const {
+    const MappedTripleTree &file = *lazy->file;
+    vector<uint64_t> &path = lazy->path;
+    while (!path.empty() && !Contains(file.NodeAt(path.back()), node)) {
+        path.pop_back();
+    }
+    if (path.empty()) {
+        path.push_back(0);
+    }
+    while (true) {
+        const FlatNode &flat = file.NodeAt(path.back());
+        if (flat.x == node->upperleft.first && flat.y == node->upperleft.second
+                && flat.width == node->width && flat.height == node->height) {
+            index = path.back();
+            return true;
+        }
+        // children follow their parent, so the walk always ends
+        unsigned int children = FileChildren(file, path.back());
+        uint64_t child = flat.firstChild;
+        while (child < flat.firstChild + children && !Contains(file.NodeAt(child), node)) {
+            child++;
+        }
+        if (child == flat.firstChild + children) {
+            return false;
+        }
+        path.push_back(child);
+    }
+}
+
+/**
+ * Builds the children of a node SummedNode or FileNode left unsplit,
+ * splitting its rectangle as BuildNode would or reading them from the
+ * file. The source is dropped once no node is left to build.
+ *
+ * @param node - node of this tree whose var is negated
+ */
+void TripleTree::ExpandNode(Node* node) const {
+    INSTRUMENT(stats.nodesExpanded++);
+    node->var = -node->var;
+    Node **slots[3] = { &node->A, &node->B, &node->C };
+    uint64_t index;
+    if (lazy->file != nullptr && FileIndex(node, index)) {
+        // a node with two children has A and C
+        const FlatNode &flat = lazy->file->NodeAt(index);
+        for (unsigned int i = 0; i < flat.numChildren; i++) {
+            *slots[(flat.numChildren == 2 && i == 1) ? 2 : i] = FileNode(flat.firstChild + i);
+        }
+    } else if (lazy->file == nullptr) {
+        unsigned int sizes[3];
+        bool wide = SplitSizes(node->width, node->height, sizes);
+        unsigned int offsets[3] = { 0, sizes[0], sizes[0] + sizes[1] };
+        for (int i = 0; i < 3; i++) {
+            if (sizes[i] == 0) {
+                continue;
+            }
+            *slots[i] = wide ? SummedNode(make_pair(node->upperleft.first + offsets[i], node->upperleft.second), sizes[i], node->height)
+                             : SummedNode(make_pair(node->upperleft.first, node->upperleft.second + offsets[i]), node->width, sizes[i]);
+        }
+    }
+    if (--lazy->pending == 0 && !lazy->budgeted) {
+        delete lazy;
+        lazy = nullptr;
+    }
+}
+
+/**
+ * Takes three nodes and returns the average of all three nodes (from the average of their leaf nodes
+ * if nodes are not leaf nodes)
+ * 
+ * @param a - first node
+ * @param b - second node
+ * @param c - third node
+ */
+RGBAPixel TripleTree::FindAverage(Node *a, Node *b, Node *c) {
+    Weighted parts[3] = { Weigh(a), Weigh(b), Weigh(c) };
+    Weighted avg = Combine(parts, 3);
+    return RGBAPixel(avg.r, avg.g, avg.b, avg.a);
+}
+
+/**
+ * Takes two nodes and returns the average of all two nodes (from the average of their leaf nodes
+ * if nodes are not leaf nodes)
+ * 
+ * @param a - first node (based off triple tree structure)
+ * @param c - third node (based off triple tree structure)
+ */
+RGBAPixel TripleTree::FindAverage(Node *a, Node *c) {
+    Weighted parts[2] = { Weigh(a), Weigh(c) };
+    Weighted avg = Combine(parts, 2);
+    return RGBAPixel(avg.r, avg.g, avg.b, avg.a);
+}
+
+/**
+ * Pushes the children of a node onto a traversal stack, C first, so that
+ * popping visits them in the same A, B, C order as a recursive walk.
+ *
+ * @param stack - explicit traversal stack
+ * @param node - non-leaf node whose children are pushed
+ */
+static inline void PushChildren(vector<Node*> &stack, Node *node) {
+    stack.push_back(node->C);
+    if (node->B != nullptr) {
+        stack.push_back(node->B);
+    }
+    stack.push_back(node->A);
+}
+
+/**
+ * Pushes the child pointers of a node onto a traversal stack, C first, so
+ * that a walk can replace children it modifies in their parent.
+ *
+ * @param stack - explicit traversal stack of child pointers
+ * @param node - unshared non-leaf node whose child pointers are pushed
+ */
+static inline void PushChildSlots(vector<Node**> &stack, Node *node) {
+    stack.push_back(&node->C);
+    if (node->B != nullptr) {
+        stack.push_back(&node->B);
+    }
+    stack.push_back(&node->A);
+}
+
+/**
+ * Helper function to calculate number of leaves in Triple Tree structure.
+ * 
+ * @param subRoot - root to count leaves
+ */
+uint64_t TripleTree::leaves(Node* subRoot) const {
+    uint64_t count = 0;
+    vector<Node*> stack;
+    if (subRoot != nullptr) {
+        stack.push_back(subRoot);
+    }
+    while (!stack.empty()) {
+        Node *node = stack.back();
+        stack.pop_back();
+        if (node->A == nullptr && node->B == nullptr && node->C == nullptr) {
+            count++;
+        } else {
+            PushChildren(stack, node);
+        }
+    }
+    return count;
+}
+
+/**
+ * Helper function to calculate the number of levels in Triple Tree structure.
+ * 
+ * @param subRoot - root to measure
+ */
+unsigned int TripleTree::height(Node* subRoot) const {
+    if (subRoot == nullptr) {
+        return 0;
+    }
+    unsigned int levels = 0;
+    vector<pair<Node*, unsigned int>> stack(1, make_pair(subRoot, 1u));
+    while (!stack.empty()) {
+        Node *node = stack.back().first;
+        unsigned int level = stack.back().second;
+        stack.pop_back();
+        levels = max(levels, level);
+        if (node->A != nullptr) {
+            stack.push_back(make_pair(node->A, level + 1));
+        }
+        if (node->B != nullptr) {
+            stack.push_back(make_pair(node->B, level + 1));
+        }
+        if (node->C != nullptr) {
+            stack.push_back(make_pair(node->C, level + 1));
+        }
+    }
+    return levels;
+}
+
+/**
+ * Helper function to render Triple Tree structure into a PNG.
+ * 
+ * @param img - reference to PNG structure
+ * @param subRoot - pointer to node containing Triple Tree structure
+ */
+void TripleTree::renderHelper(PNG &img, Node *subRoot) const {
+    vector<Node*> stack(1, subRoot);
+    while (!stack.empty()) {
+        Node *node = stack.back();
+        stack.pop_back();
+        if (node->A == nullptr && node->B == nullptr && node->C == nullptr) {
+            fillHelper(img, node);
+        } else {
+            PushChildren(stack, node);
+        }
+    }
+}
+
+/**
+ * Helper function to render Triple Tree structure into a PNG, treating
+ * nodes at the given depth as leaves.
+ *
+ * @param img - reference to PNG structure
+ * @param subRoot - pointer to node containing Triple Tree structure
+ * @param depth - number of levels still allowed below subRoot
+ */
+void TripleTree::renderDepthHelper(PNG &img, Node *subRoot, int depth) const {
+    vector<pair<Node*, int>> stack(1, make_pair(subRoot, depth));
+    while (!stack.empty()) {
+        Node *node = stack.back().first;
+        int remaining = stack.back().second;
+        stack.pop_back();
+        if (remaining > 0) {
+            Reach(node);
+        }
+        if (remaining <= 0 || (node->A == nullptr && node->B == nullptr && node->C == nullptr)) {
+            fillHelper(img, node);
+        } else {
+            stack.push_back(make_pair(node->C, remaining - 1));
+            if (node->B != nullptr) {
+                stack.push_back(make_pair(node->B, remaining - 1));
+            }
+            stack.push_back(make_pair(node->A, remaining - 1));
+        }
+    }
+}
+
+/**
+ * Helper function to render the part of a subtree that falls inside a
+ * viewport. Subtrees entirely outside the viewport are skipped.
+ *
+ * @param img - viewport-sized PNG
+ * @param subRoot - pointer to node containing Triple Tree structure
+ * @param x - left edge of the viewport in image coordinates
+ * @param y - top edge of the viewport in image coordinates
+ */
+void TripleTree::regionHelper(PNG &img, Node *subRoot, unsigned int x, unsigned int y) const {
+    vector<Node*> stack(1, subRoot);
+    while (!stack.empty()) {
+        Node *node = stack.back();
+        stack.pop_back();
+        // intersection of the node's rectangle with the viewport, in image coordinates
+        unsigned long left = max((unsigned long) node->upperleft.first, (unsigned long) x);
+        unsigned long top = max((unsigned long) node->upperleft.second, (unsigned long) y);
+        unsigned long right = min((unsigned long) node->upperleft.first + node->width, (unsigned long) x + img.width());
+        unsigned long bottom = min((unsigned long) node->upperleft.second + node->height, (unsigned long) y + img.height());
+        if (left >= right || top >= bottom) {
+            continue;
+        }
+        Reach(node);
+        if (node->A == nullptr && node->B == nullptr && node->C == nullptr) {
+            INSTRUMENT(queryStats.pixelsFilled.fetch_add((right - left) * (bottom - top), memory_order_relaxed));
+            for (unsigned long py = top; py < bottom; py++) {
+                RGBAPixel *row = img.getPixel(left - x, py - y);
+                for (unsigned long px = 0; px < right - left; px++) {
+                    row[px] = node->avg;
+                }
+            }
+        } else {
+            PushChildren(stack, node);
         }
-    } else {
-        // not leaf node
-        if (subRoot->B != nullptr)
-            return ShouldPrune(subRoot->A, avg, tol) && ShouldPrune(subRoot->B, avg, tol) && ShouldPrune(subRoot->C, avg, tol);
-        else
-            return ShouldPrune(subRoot->A, avg, tol) && ShouldPrune(subRoot->C, avg, tol);
     }
 }
 
-Node* TripleTree::FlipHorizontalHelperRotate(Node*& subRoot) {
-    if (subRoot == NULL) {
-        return NULL;
+/**
+ * Helper function for AverageOver. Adds the colors of the part of a
+ * subtree that falls inside the rectangle, weighted by covered area.
+ *
+ * @param sum - weighted sums of r, g, b, a and the total weight
+ * @param subRoot - pointer to node containing Triple Tree structure
+ * @param x - left edge of the rectangle
+ * @param y - top edge of the rectangle
+ * @param w - width of the rectangle
+ * @param h - height of the rectangle
+ */
+void TripleTree::averageHelper(double *sum, Node *subRoot, unsigned int x, unsigned int y, unsigned int w, unsigned int h) const {
+    vector<Node*> stack(1, subRoot);
+    while (!stack.empty()) {
+        Node *node = stack.back();
+        stack.pop_back();
+        unsigned long left = max((unsigned long) node->upperleft.first, (unsigned long) x);
+        unsigned long top = max((unsigned long) node->upperleft.second, (unsigned long) y);
+        unsigned long right = min((unsigned long) node->upperleft.first + node->width, (unsigned long) x + w);
+        unsigned long bottom = min((unsigned long) node->upperleft.second + node->height, (unsigned long) y + h);
+        if (left >= right || top >= bottom) {
+            continue;
+        }
+        double area = (double) (right - left) * (bottom - top);
+        bool covered = area == (double) node->width * node->height;
+        if (!covered) {
+            Reach(node);
+        }
+        if (covered || (node->A == nullptr && node->B == nullptr && node->C == nullptr)) {
+            sum[0] += area * node->avg.r;
+            sum[1] += area * node->avg.g;
+            sum[2] += area * node->avg.b;
+            sum[3] += area * node->avg.a;
+            sum[4] += area;
+        } else {
+            PushChildren(stack, node);
+        }
     }
+}
+
+/**
+ * Helper function for the scaled render. Accumulates each node that is a
+ * leaf or projects inside a single output pixel into the output pixels it
+ * overlaps, weighted by the overlapping area in output space.
+ *
+ * @param acc - per output pixel sums of r, g, b, a and weight
+ * @param subRoot - pointer to node containing Triple Tree structure
+ * @param outW - width of the output image
+ * @param outH - height of the output image
+ * @param sx - horizontal scale from image to output coordinates
+ * @param sy - vertical scale from image to output coordinates
+ */
+void TripleTree::scaledHelper(vector<double> &acc, Node *subRoot, unsigned int outW, unsigned int outH, double sx, double sy) const {
+    vector<Node*> stack(1, subRoot);
+    while (!stack.empty()) {
+        Node *node = stack.back();
+        stack.pop_back();
+        double left = node->upperleft.first * sx;
+        double right = (node->upperleft.first + node->width) * sx;
+        double top = node->upperleft.second * sy;
+        double bottom = (node->upperleft.second + node->height) * sy;
+        // a node straddling output pixels is split, so that its pixels
+        // count towards the output pixels they lie in
+        bool within = ceil(right) <= floor(left) + 1 && ceil(bottom) <= floor(top) + 1;
+        if (!within) {
+            Reach(node);
+        }
+        bool leaf = node->A == nullptr && node->B == nullptr && node->C == nullptr;
+        if (!leaf && !within) {
+            PushChildren(stack, node);
+            continue;
+        }
 
-    if (subRoot->A == NULL && subRoot->B == NULL && subRoot->C == NULL) {
-        return subRoot;
+        unsigned int x0 = (unsigned int) left;
+        unsigned int x1 = min((unsigned int) ceil(right), outW);
+        unsigned int y0 = (unsigned int) top;
+        unsigned int y1 = min((unsigned int) ceil(bottom), outH);
+        INSTRUMENT(queryStats.pixelsFilled.fetch_add((uint64_t) (x1 - min(x0, x1)) * (y1 - min(y0, y1)), memory_order_relaxed));
+        for (unsigned int y = y0; y < y1; y++) {
+            double coverY = min(bottom, y + 1.0) - max(top, (double) y);
+            for (unsigned int x = x0; x < x1; x++) {
+                double weight = coverY * (min(right, x + 1.0) - max(left, (double) x));
+                if (weight <= 0) {
+                    continue;
+                }
+                double *p = &acc[((size_t) y * outW + x) * 5];
+                p[0] += weight * node->avg.r;
+                p[1] += weight * node->avg.g;
+                p[2] += weight * node->avg.b;
+                p[3] += weight * node->avg.a;
+                p[4] += weight;
+            }
+        }
     }
+}
 
-    if (subRoot->height > subRoot->width) {
-        FlipHorizontalHelper(subRoot->A); 
-        FlipHorizontalHelper(subRoot->B);
-        FlipHorizontalHelper(subRoot->C);
-        return subRoot; 
-    } else { // width >= height
-        FlipHorizontalHelper(subRoot->A); 
-        FlipHorizontalHelper(subRoot->B);
-        FlipHorizontalHelper(subRoot->C);
+/**
+ * Helper function to paint a node's rectangle with its average color.
+ *
+ * @param img - reference to PNG structure
+ * @param subRoot - pointer to node whose rectangle is painted
+ */
+void TripleTree::fillHelper(PNG &img, Node *subRoot) const {
+    INSTRUMENT(queryStats.pixelsFilled.fetch_add((uint64_t) subRoot->width * subRoot->height, memory_order_relaxed));
+    for (unsigned int y = 0; y < subRoot->height; y++) {
+        for (unsigned int x = 0; x < subRoot->width; x++) {
+            RGBAPixel *t = img.getPixel(subRoot->upperleft.first + x, subRoot->upperleft.second + y);
+            *t = subRoot->avg;
+        }
+    }
+}
 
-        unsigned int difference = abs((double) subRoot->A->upperleft.first - subRoot->C->upperleft.first);
+/**
+ * Releases the nodes on a traversal stack. Nodes still referenced by
+ * another tree or parent are kept, and their subtrees are not visited.
+ *
+ * @param stack - nodes to release, emptied on return
+ */
+static void ReleaseNodes(vector<Node*> &stack) {
+    while (!stack.empty()) {
+        Node *node = stack.back();
+        stack.pop_back();
+        if (--node->refs > 0) {
+            continue;
+        }
+        if (node->A != nullptr) {
+            PushChildren(stack, node);
+        }
+        INSTRUMENT(liveNodes--);
+        delete node;
+    }
+}
 
-        if (subRoot->A->upperleft.first > subRoot->C->upperleft.first) {
-            MoveToLeft(subRoot->A, difference);
-            MoveToRight(subRoot->C, difference);
+/**
+ * Helper function to copy a node on write. The clone shares the node's
+ * children, and the caller hands over one of the node's references to it;
+ * if that was the last one, the node is released.
+ *
+ * @param node - shared node to copy
+ */
+Node* TripleTree::CloneNode(Node* node) {
+    Node *copy = new Node(node->upperleft, node->width, node->height);
+    INSTRUMENT(stats.nodesAllocated++; stats.nodesCloned++; liveNodes++);
+    copy->avg = node->avg;
+    copy->var = node->var;
+    copy->A = node->A;
+    copy->B = node->B;
+    copy->C = node->C;
+    if (copy->A != nullptr) {
+        copy->A->refs++;
+    }
+    if (copy->B != nullptr) {
+        copy->B->refs++;
+    }
+    if (copy->C != nullptr) {
+        copy->C->refs++;
+    }
+    // another tree may have dropped its reference since the caller saw the
+    // node shared, leaving the caller's the last one
+    if (--node->refs == 0) {
+        vector<Node*> stack;
+        if (node->A != nullptr) {
+            PushChildren(stack, node);
+        }
+        INSTRUMENT(liveNodes--);
+        delete node;
+        ReleaseNodes(stack);
+    }
+    return copy;
+}
+
+/**
+ * Helper function to make the node stored in slot safe to modify. A node
+ * that is shared is replaced in slot by a clone. slot must belong to this
+ * tree alone, i.e. be the root pointer or a field of an unshared node.
+ *
+ * @param slot - pointer to the node, in its parent or the root
+ */
+Node* TripleTree::Unshare(Node*& slot) {
+    if (slot->refs > 1) {
+        slot = CloneNode(slot);
+    }
+    return slot;
+}
+
+/**
+ * Helper function to deallocate and delete Triple Tree structure. Only
+ * nodes that no other tree shares are deleted.
+ * 
+ * @param subRoot - pointer to Node containing Triple Tree structure
+ */
+void TripleTree::clearHelper(Node* subRoot) {
+    if (subRoot == nullptr) {
+        return;
+    }
+    vector<Node*> stack(1, subRoot);
+    ReleaseNodes(stack);
+}
+
+/**
+ * Helper function to release every subtree of a node, leaving the node
+ * itself as a leaf. The node must not be shared.
+ *
+ * @param subRoot - node whose subtrees are released
+ * @param stack - scratch traversal stack, reused between calls
+ */
+void TripleTree::clearChildren(Node* subRoot, vector<Node*> &stack) {
+    if (subRoot->A == nullptr && subRoot->B == nullptr && subRoot->C == nullptr) {
+        return;
+    }
+    PushChildren(stack, subRoot);
+    subRoot->A = nullptr;
+    subRoot->B = nullptr;
+    subRoot->C = nullptr;
+    ReleaseNodes(stack);
+}
+
+/**
+ * Helper function to mirror a subtree over the vertical line through the
+ * middle of its rectangle. Mirroring is the same reflection for every
+ * node, x -> left + right - x, so each node is moved exactly once, and A
+ * and C trade places in every node split left to right. Shared nodes are
+ * cloned as they are reached.
+ *
+ * @param subRoot - pointer to Node containing Triple Tree structure
+ */
+Node* TripleTree::FlipHorizontalHelper(Node*& subRoot) {
+    if (subRoot == nullptr) {
+        return nullptr;
+    }
+    unsigned int mirror = 2 * subRoot->upperleft.first + subRoot->width;
+    vector<Node**> stack(1, &subRoot);
+    while (!stack.empty()) {
+        Node *node = Unshare(*stack.back());
+        stack.pop_back();
+        node->upperleft.first = mirror - node->upperleft.first - node->width;
+        if (node->A == nullptr && node->B == nullptr && node->C == nullptr) {
+            continue;
+        }
+        if (node->width >= node->height) {
+            std::swap(node->A, node->C);
+        }
+        PushChildSlots(stack, node);
+    }
+    return subRoot;
+}
+
+/**
+ * Helper function to rotate a subtree 90 degrees counter-clockwise, as a
+ * mirror over its vertical middle line followed by a transpose, applied to
+ * every node in one pass. Mirroring trades A and C in every node split
+ * left to right except subRoot, and transposing trades them back in the
+ * same nodes, so only subRoot's children change places. Shared nodes are
+ * cloned as they are reached.
+ *
+ * @param subRoot - pointer to Node containing Triple Tree structure
+ */
+Node* TripleTree::RotateCCWHelper(Node*& subRoot) {
+    if (subRoot == nullptr) {
+        return nullptr;
+    }
+    bool leaf = subRoot->A == nullptr && subRoot->B == nullptr && subRoot->C == nullptr;
+    bool wide = subRoot->width >= subRoot->height;
+    unsigned int mirror = 2 * subRoot->upperleft.first + subRoot->width;
+    vector<Node**> stack(1, &subRoot);
+    while (!stack.empty()) {
+        Node *node = Unshare(*stack.back());
+        stack.pop_back();
+        node->upperleft.first = mirror - node->upperleft.first - node->width;
+        std::swap(node->upperleft.first, node->upperleft.second);
+        std::swap(node->width, node->height);
+        if (node->A != nullptr) {
+            PushChildSlots(stack, node);
+        }
+    }
+    if (!leaf && wide) {
+        std::swap(subRoot->A, subRoot->C);
+    }
+    return subRoot;
+}
+
+/**
+ * Helper function to prune the Triple Tree structure. Nodes are visited
+ * top-down so that subtrees are pruned as high as possible, and every
+ * test sees the original leaves below it.
+ *
+ * Nodes this tree owns alone are pruned in place. Below a shared node,
+ * the visited nodes are only recorded; afterwards, the shared nodes on
+ * the paths down to each pruned node are cloned, parents first, and
+ * every other shared node is left untouched.
+ * 
+ * @param subRoot - pointer to Node containing Triple Tree structure
+ * @param tol - number corresponding to distanceTo function which will determine which nodes to prune
+ * @param shouldPrune - whether to prune a node, e.g. ShouldPrune for the color metric
+ */
+Node* TripleTree::PruneHelper(Node* subRoot, double tol, const PruneTest& shouldPrune) {
+    if (subRoot == nullptr) return nullptr;
+
+    struct Visit {
+        Node *node;
+        Node **slot;  // where node is stored, if its parent is not shared
+        int64_t parent; // index of the shared parent's Shared record, or -1
+        int child;    // 0, 1 or 2 for A, B or C of the shared parent
+    };
+    struct Shared {
+        Node *node;
+        Node **slot;
+        int64_t parent;
+        int child;
+        bool prune;   // node's subtrees are to be cleared
+        bool modified; // node or a descendant is pruned, so it must be cloned
+        Node *copy;
+    };
+    vector<Visit> stack(1, Visit{ subRoot, &subRoot, -1, 0 });
+    vector<Shared> shared;
+    vector<Node*> scratch;
+    while (!stack.empty()) {
+        Visit visit = stack.back();
+        stack.pop_back();
+        Node *node = visit.node;
+        if (node->A == nullptr && node->B == nullptr && node->C == nullptr) {
+            continue;
+        }
+        bool prune = shouldPrune(node, node->avg, tol, scratch);
+        if (visit.parent < 0 && node->refs == 1) {
+            if (prune) {
+                clearChildren(node, scratch);
+            } else {
+                stack.push_back(Visit{ node->C, &node->C, -1, 0 });
+                if (node->B != nullptr) {
+                    stack.push_back(Visit{ node->B, &node->B, -1, 0 });
+                }
+                stack.push_back(Visit{ node->A, &node->A, -1, 0 });
+            }
+            continue;
+        }
+
+        int64_t index = shared.size();
+        shared.push_back(Shared{ node, visit.slot, visit.parent, visit.child, prune, false, nullptr });
+        if (prune) {
+            for (int64_t i = index; i >= 0 && !shared[i].modified; i = shared[i].parent) {
+                shared[i].modified = true;
+            }
         } else {
-            MoveToRight(subRoot->A, difference);
-            MoveToLeft(subRoot->C, difference);
+            stack.push_back(Visit{ node->C, nullptr, index, 2 });
+            if (node->B != nullptr) {
+                stack.push_back(Visit{ node->B, nullptr, index, 1 });
+            }
+            stack.push_back(Visit{ node->A, nullptr, index, 0 });
+        }
+    }
+
+    // records are in pre-order, so every parent is cloned before its children
+    for (Shared& record : shared) {
+        if (!record.modified) {
+            continue;
+        }
+        Node **slot = record.slot;
+        if (record.parent >= 0) {
+            Node *parent = shared[record.parent].copy;
+            slot = (record.child == 0) ? &parent->A : (record.child == 1) ? &parent->B : &parent->C;
+        }
+        record.copy = CloneNode(record.node);
+        *slot = record.copy;
+        if (record.prune) {
+            clearChildren(record.copy, scratch);
+        }
+    }
+    return subRoot;
+}
+
+/**
+ * PruneByVariance's test for PruneHelper: whether the subtree's mean
+ * squared distance from its average is within tol.
+ *
+ * @param subRoot - node to test
+ * @param avg - unused, the error is relative to subRoot's own average
+ * @param tol - maximum mean squared color distance
+ * @param stack - unused
+ */
+bool TripleTree::VarianceWithin(Node* subRoot, RGBAPixel avg, double tol, vector<Node*> &stack) {
+    (void) avg;
+    (void) stack;
+    return subRoot->var <= tol;
+}
+
+/**
+ * PruneByVariance's threshold for incremental pruning: the node's mean
+ * squared distance from its average, kept since the build.
+ *
+ * @param subRoot - split node to measure
+ * @param stack - unused
+ */
+double TripleTree::VarianceThreshold(Node* subRoot, vector<Node*> &stack) {
+    (void) stack;
+    return subRoot->var;
+}
+
+/**
+ * Copies a subtree into new nodes that share nothing with it.
+ *
+ * @param subRoot - root of the subtree to copy
+ */
+Node* TripleTree::DeepCopy(Node* subRoot) {
+    Node *copy = subRoot;
+    vector<Node**> stack;
+    if (copy != nullptr) {
+        stack.push_back(&copy);
+    }
+    while (!stack.empty()) {
+        Node **slot = stack.back();
+        stack.pop_back();
+        Node *node = *slot;
+        Node *clone = new Node(node->upperleft, node->width, node->height);
+        INSTRUMENT(stats.nodesAllocated++; liveNodes++);
+        clone->avg = node->avg;
+        clone->var = node->var;
+        clone->A = node->A;
+        clone->B = node->B;
+        clone->C = node->C;
+        *slot = clone;
+        if (clone->A != nullptr) {
+            PushChildSlots(stack, clone);
+        }
+    }
+    return copy;
+}
+
+/**
+ * Turns incremental pruning on or off. Turning it on first gives this tree
+ * its own copy of any nodes it shares, since collapsing a node changes it
+ * in place; turning it off frees the collapsed subtrees.
+ *
+ * @param on - whether to keep pruned subtrees
+ */
+void TripleTree::SetIncrementalPrune(bool on) {
+    if (on && refinement == nullptr) {
+        Detach();
+        vector<Node**> stack;
+        if (root != nullptr) {
+            stack.push_back(&root);
+        }
+        while (!stack.empty()) {
+            Node *node = Unshare(*stack.back());
+            stack.pop_back();
+            if (node->A != nullptr) {
+                PushChildSlots(stack, node);
+            }
+        }
+        refinement = new Refinement();
+        refinement->tol = -1;
+        refinement->threshold = nullptr;
+    } else if (!on && refinement != nullptr) {
+        vector<Node*> stack;
+        for (Refinement::Entry& entry : refinement->entries) {
+            for (Node *child : { entry.A, entry.B, entry.C }) {
+                if (child != nullptr) {
+                    stack.push_back(child);
+                }
+            }
         }
-        return subRoot;
+        ReleaseNodes(stack);
+        delete refinement;
+        refinement = nullptr;
+    }
+}
+
+/**
+ * Moves the tree to the pruning given by tol under the criterion whose
+ * thresholds threshold computes. If that is not the criterion of the
+ * current thresholds, the tree is fully expanded and every split node's
+ * threshold computed first.
+ *
+ * @param tol - the new tolerance
+ * @param threshold - computes the smallest tol that prunes a node
+ */
+void TripleTree::RefineTo(double tol, PruneThreshold threshold) {
+    if (refinement->threshold != threshold) {
+        Toggle(-1);
+        vector<Refinement::Entry>& entries = refinement->entries;
+        entries.clear();
+        vector<Node*> stack, scratch;
+        if (root != nullptr) {
+            stack.push_back(root);
+        }
+        while (!stack.empty()) {
+            Node *node = stack.back();
+            stack.pop_back();
+            if (node->A == nullptr) {
+                continue;
+            }
+            entries.push_back(Refinement::Entry{ (this->*threshold)(node, scratch), node, nullptr, nullptr, nullptr });
+            PushChildren(stack, node);
+        }
+        sort(entries.begin(), entries.end(),
+            [](const Refinement::Entry& x, const Refinement::Entry& y) { return x.threshold < y.threshold; });
+        refinement->threshold = threshold;
+    }
+    Toggle(tol);
+}
+
+/**
+ * Collapses or expands the nodes whose thresholds lie between the current
+ * tol and the new one, and nothing else.
+ *
+ * @param tol - the new tolerance
+ */
+void TripleTree::Toggle(double tol) {
+    vector<Refinement::Entry>& entries = refinement->entries;
+    auto byThreshold = [](double t, const Refinement::Entry& entry) { return t < entry.threshold; };
+    auto first = upper_bound(entries.begin(), entries.end(), min(tol, refinement->tol), byThreshold);
+    auto last = upper_bound(first, entries.end(), max(tol, refinement->tol), byThreshold);
+    for (auto entry = first; entry != last; ++entry) {
+        std::swap(entry->node->A, entry->A);
+        std::swap(entry->node->B, entry->B);
+        std::swap(entry->node->C, entry->C);
+    }
+    INSTRUMENT(stats.nodesToggled += last - first);
+    refinement->tol = tol;
+}
+
+/**
+ * Chooses the split nodes PruneToQuality prunes and adds the highest of
+ * them, sorted, to collapsing. A visible node's squared error is its pixel
+ * count times its var, so collapsing a node once its split children are
+ * collapsed adds its own error less that of its children. A node can only
+ * be collapsed after its split descendants, so it is ranked by the largest
+ * cost among them and itself; the nodes are sorted by rank, children
+ * before parents on ties, and the longest prefix within the budget taken.
+ * This is the order a priority queue of the collapsible nodes would give,
+ * up to ties, in one sort.
+ *
+ * @param targetPSNR - lowest acceptable PSNR, in decibels
+ * @param collapsing - empty on entry; receives the chosen nodes
+ * @return the PSNR of the tree once the chosen nodes are pruned
+ */
+double TripleTree::ChooseCollapses(double targetPSNR, vector<Node*> &collapsing) {
+    struct Split {
+        Node *node;
+        int64_t parent; // index of the parent's record, or -1
+        double cost;  // error added by collapsing the node after its children
+        double order; // largest cost of the node and its split descendants
+    };
+    vector<Split> splits;
+    vector<pair<Node*, int64_t>> stack;
+    double error = 0;
+    if (root != nullptr) {
+        stack.push_back(make_pair(root, -1));
+    }
+    // records are in pre-order, so every parent precedes its children
+    while (!stack.empty()) {
+        Node *node = stack.back().first;
+        int64_t parent = stack.back().second;
+        stack.pop_back();
+        double nodeError = (double) node->width * node->height * node->var;
+        if (parent >= 0) {
+            splits[parent].cost -= nodeError;
+        }
+        if (node->A == nullptr) {
+            error += nodeError;
+            continue;
+        }
+        int64_t index = splits.size();
+        splits.push_back(Split{ node, parent, nodeError, -numeric_limits<double>::infinity() });
+        stack.push_back(make_pair(node->C, index));
+        if (node->B != nullptr) {
+            stack.push_back(make_pair(node->B, index));
+        }
+        stack.push_back(make_pair(node->A, index));
+    }
+
+    // children come before parents, ties included: larger indices first
+    vector<pair<double, int64_t>> order(splits.size());
+    for (int64_t i = (int64_t) splits.size() - 1; i >= 0; i--) {
+        Split &split = splits[i];
+        split.order = max(split.order, split.cost);
+        if (split.parent >= 0) {
+            splits[split.parent].order = max(splits[split.parent].order, split.order);
+        }
+        order[i] = make_pair(split.order, -i);
+    }
+    sort(order.begin(), order.end());
+
+    // four channels per pixel; the margin covers the rounding of var to float
+    double channels = (root == nullptr) ? 0 : 4.0 * root->width * root->height;
+    double budget = channels * pow(10.0, -targetPSNR / 10) * (1 - 1e-5);
+    vector<bool> chosen(splits.size(), false);
+    for (const pair<double, int64_t>& next : order) {
+        Split &split = splits[-next.second];
+        if (error + split.cost > budget) {
+            break;
+        }
+        error += split.cost;
+        chosen[-next.second] = true;
+    }
+    for (size_t i = 0; i < splits.size(); i++) {
+        if (chosen[i] && (splits[i].parent < 0 || !chosen[splits[i].parent])) {
+            collapsing.push_back(splits[i].node);
+        }
+    }
+    sort(collapsing.begin(), collapsing.end());
+    return (error > 0) ? 10 * log10(channels / error) : numeric_limits<double>::infinity();
+}
+
+/**
+ * Builds every node of a lazy tree that is still missing.
+ */
+void TripleTree::ExpandAll() const {
+    vector<Node*> stack;
+    if (lazy != nullptr) {
+        stack.push_back(root);
+    }
+    while (lazy != nullptr && !stack.empty()) {
+        Node *node = stack.back();
+        stack.pop_back();
+        Reach(node);
+        if (node->A != nullptr) {
+            PushChildren(stack, node);
+        }
+    }
+}
+
+/**
+ * Visits the nodes of a budgeted tree down to maxDepth in depth-first A,
+ * B, C order, building missing children on the way, and trims to the
+ * budget after each subtree of at most EVICTION_PIXELS pixels whose
+ * parent is larger. No such subtree lies inside an evictable one, so the
+ * nodes waiting on the walk's stack survive every trim, and the tree
+ * never holds more than the budget and one subtree besides.
+ *
+ * @param maxDepth - deepest level to visit, the root being level 0
+ * @param visit - called with each node, its children built, and its depth
+ */
+void TripleTree::trimmedWalk(int maxDepth, const function<void(Node*, int)>& visit) const {
+    // visits one node and pushes its children, C first, onto stack
+    auto step = [&](pair<Node*, int> entry, vector<pair<Node*, int>> &stack) {
+        Node *node = entry.first;
+        Reach(node);
+        visit(node, entry.second);
+        if (entry.second < maxDepth && node->A != nullptr) {
+            stack.push_back(make_pair(node->C, entry.second + 1));
+            if (node->B != nullptr) {
+                stack.push_back(make_pair(node->B, entry.second + 1));
+            }
+            stack.push_back(make_pair(node->A, entry.second + 1));
+        }
+    };
+    vector<pair<Node*, int>> outer(1, make_pair(root, 0));
+    vector<pair<Node*, int>> inner;
+    while (!outer.empty()) {
+        pair<Node*, int> entry = outer.back();
+        outer.pop_back();
+        if ((unsigned long) entry.first->width * entry.first->height > EVICTION_PIXELS) {
+            step(entry, outer);
+            continue;
+        }
+        inner.push_back(entry);
+        while (!inner.empty()) {
+            entry = inner.back();
+            inner.pop_back();
+            step(entry, inner);
+        }
+        Trim();
+    }
+}
+
+/**
+ * Builds every node of a lazy tree, then drops its source and takes it
+ * off the node budget, so that it can be changed like any other tree.
+ */
+void TripleTree::Detach() {
+    ExpandAll();
+    ReleaseSource(lazy);
+    lazy = nullptr;
+}
+
+/**
+ * Reach for lazy trees: builds the node's children if they are missing,
+ * and moves a deep subtree of a budgeted tree to the front of the
+ * eviction order.
+ *
+ * @param node - node of this tree about to be descended into
+ */
+void TripleTree::Visit(Node* node) const {
+    if (!signbit(node->var)) {
+        if (!lazy->budgeted || !IsDeepSubtree(node) || node->A == nullptr) {
+            return;
+        }
+        NodeBudget &budget = Budget();
+        auto found = budget.index.find(node);
+        if (found != budget.index.end()) {
+            budget.resident.splice(budget.resident.begin(), budget.resident, found->second);
+        }
+        return;
+    }
+    // an unbudgeted source is dropped once its last node is built
+    LazySource *source = lazy->budgeted ? lazy : nullptr;
+    ExpandNode(node);
+    if (source != nullptr && IsDeepSubtree(node)) {
+        if (source->evicted.erase(node) > 0) {
+            INSTRUMENT(stats.subtreesReexpanded++);
+        }
+        NodeBudget &budget = Budget();
+        budget.resident.push_front(make_pair(source, node));
+        budget.index[node] = budget.resident.begin();
+    }
+}
+
+/**
+ * Returns the node budget, which is never destroyed, so trees destroyed
+ * by static destructors can still leave it.
+ */
+TripleTree::NodeBudget& TripleTree::Budget() {
+    static NodeBudget *budget = new NodeBudget{ 0, 0, 0, 0, {}, {} };
+    return *budget;
+}
+
+/**
+ * Deletes a lazy source, first taking its tree's nodes and deep subtrees
+ * off the node budget. A null source is ignored.
+ *
+ * @param source - source being dropped, or nullptr
+ */
+void TripleTree::ReleaseSource(LazySource* source) {
+    if (source == nullptr) {
+        return;
+    }
+    if (source->budgeted) {
+        NodeBudget &budget = Budget();
+        budget.nodes -= source->nodes;
+        for (auto it = budget.resident.begin(); it != budget.resident.end();) {
+            if (it->first == source) {
+                budget.index.erase(it->second);
+                it = budget.resident.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    delete source;
+}
+
+/**
+ * Collapses a deep subtree of a budgeted tree back to its unbuilt node,
+ * freeing every node below it. Its var is negated again, so the next
+ * visit builds the children as the first one did.
+ *
+ * @param source - source of the tree node belongs to
+ * @param node - expanded deep subtree, which stays in the tree
+ */
+void TripleTree::Evict(LazySource* source, Node* node) {
+    NodeBudget &budget = Budget();
+    vector<Node*> stack;
+    PushChildren(stack, node);
+    node->A = nullptr;
+    node->B = nullptr;
+    node->C = nullptr;
+    node->var = -node->var;
+    source->pending++;
+    source->evicted.insert(node);
+    size_t freed = 0;
+    while (!stack.empty()) {
+        Node *n = stack.back();
+        stack.pop_back();
+        if (n->A != nullptr) {
+            PushChildren(stack, n);
+        }
+        if (signbit(n->var)) {
+            source->pending--;
+        }
+        if (IsDeepSubtree(n)) {
+            auto found = budget.index.find(n);
+            if (found != budget.index.end()) {
+                budget.resident.erase(found->second);
+                budget.index.erase(found);
+            }
+            source->evicted.erase(n);
+        }
+        INSTRUMENT(liveNodes--);
+        delete n;
+        freed++;
+    }
+    source->nodes -= freed;
+    budget.nodes -= freed;
+    INSTRUMENT(source->stats->subtreesEvicted++; source->stats->nodesEvicted += freed);
+}
+
+/**
+ * Evicts down to the node budget after a call on a budgeted tree, the
+ * only calls that add to it. Other trees never touch the budget.
+ */
+void TripleTree::Trim() const {
+    if (lazy != nullptr && lazy->budgeted) {
+        EvictToBudget();
+    }
+}
+
+/**
+ * Evicts the least recently visited deep subtrees of budgeted trees until
+ * they fit the node budget, unless a RenderProgressive is under way.
+ */
+void TripleTree::EvictToBudget() {
+    NodeBudget &budget = Budget();
+    while (budget.limit > 0 && budget.nodes > budget.limit && budget.holds == 0 && !budget.resident.empty()) {
+        pair<LazySource*, Node*> oldest = budget.resident.back();
+        budget.resident.pop_back();
+        budget.index.erase(oldest.second);
+        Evict(oldest.first, oldest.second);
     }
 }
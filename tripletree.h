@@ -6,6 +6,17 @@
 #ifndef _TRIPLETREE_H_
 #define _TRIPLETREE_H_
 
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#include "colormetric.h"
+#include "mappedtree.h"
+#include "summedarea.h"
+#include "cs221util/Instrument.h"
 #include "cs221util/PNG.h"
 #include "cs221util/RGBAPixel.h"
 
@@ -27,17 +38,60 @@ public:
     Node* A;	         // ptr to left or upper subtree
     Node* B;	         // ptr to middle subtree
     Node* C;	         // ptr to right or lower subtree
+    atomic<unsigned int> refs; // trees and parent nodes pointing at this node; atomic
+                               // so trees sharing nodes can be released on any thread
+    float var;           // mean squared RGBA distance of the subimage's pixels from avg,
+                         // red, green and blue scaled to [0, 1] like alpha; negated
+                         // (sign bit set) while a lazy tree has not built its children
 
     // Node constructors
-    Node(pair<unsigned int, unsigned int> ul, unsigned int w, unsigned int h) {
+    // refs is initialized rather than assigned, which would be an atomic store
+    Node(pair<unsigned int, unsigned int> ul, unsigned int w, unsigned int h) : refs(1) {
         upperleft = ul;
         width = w;
         height = h;
         avg = RGBAPixel();
+        var = 0;
         A = nullptr; B = nullptr; C = nullptr;
     }
 };
 
+/**
+ * Counters and timings collected by a TripleTree. They are only maintained
+ * when the tree is compiled with TRIPLETREE_STATS (make STATS=1); otherwise
+ * every field reads as zero.
+ */
+struct TreeStats {
+    uint64_t nodesAllocated;  // nodes created by building or copying on write
+    uint64_t nodesCloned;     // shared nodes copied before being modified
+    uint64_t maxDepth;        // number of levels built, counting the root as 1
+    uint64_t pruneLeafVisits; // leaves examined by ShouldPrune
+    uint64_t distanceCalls;   // color distances computed by ShouldPrune
+    uint64_t nodesToggled;    // nodes collapsed or expanded by incremental pruning
+    uint64_t nodesExpanded;   // lazy nodes whose children were built on first access
+    uint64_t subtreesEvicted; // deep subtrees collapsed to stay within the node budget
+    uint64_t nodesEvicted;    // nodes freed by those collapses
+    uint64_t subtreesReexpanded; // evicted subtrees visited, and so built, again
+    uint64_t nodesLive;       // process-wide nodes allocated and not yet freed when the snapshot was taken
+    uint64_t pixelsFilled;    // canvas pixels written by the render functions
+    double buildSeconds;
+    double copySeconds;
+    double pruneSeconds;
+    double transformSeconds;  // FlipHorizontal and RotateCCW
+    double renderSeconds;
+    IOStats io;               // process-wide PNG counters when the snapshot was taken
+};
+
+/**
+ * Thread safety: const members of a tree that is not lazy only read its
+ * nodes, so any number of threads may query one tree at once, provided no
+ * thread modifies it meanwhile. In builds with TRIPLETREE_STATS, the only
+ * counters queries update, pixelsFilled and renderSeconds, are atomic.
+ * Copies share nodes, with atomic reference counts, so a copy may be
+ * modified, or either tree destroyed, while the other is being read.
+ * SharedTripleTree (sharedtree.h) publishes modified copies to concurrent
+ * readers.
+ */
 class TripleTree {
 
 public:
@@ -59,6 +113,13 @@ public:
      * Since TripleTree allocate dynamic memory (i.e., they use "new", we
      * must define the Big Three). This uses your implementation
      * of the copy function.
+     *
+     * Copies share all of their nodes with other and take constant time.
+     * Nodes are reference counted and copied on write: Prune,
+     * FlipHorizontal and RotateCCW clone only the shared nodes they
+     * modify. Reference counts are atomic, so other may be copied while
+     * other threads read it, and the copy may be modified or destroyed
+     * while other is read, and the other way around.
      * @see TripleTree.cpp
      *
      * @param other - the TripleTree we are copying.
@@ -75,6 +136,32 @@ public:
      */
     TripleTree& operator=(const TripleTree& rhs);
 
+    /**
+     * Move constructor for a TripleTree. Takes over the nodes and
+     * statistics of other in constant time. other is left empty and
+     * may only be destroyed, assigned to or swapped.
+     *
+     * @param other - the TripleTree we are moving from.
+     */
+    TripleTree(TripleTree&& other) noexcept;
+
+    /**
+     * Move assignment operator for TripleTree. Releases this tree's
+     * nodes and takes over those of rhs in constant time, leaving rhs
+     * empty.
+     *
+     * @param rhs - the right hand side of the assignment statement.
+     */
+    TripleTree& operator=(TripleTree&& rhs) noexcept;
+
+    /**
+     * Exchanges the nodes and statistics of this tree and other in
+     * constant time.
+     *
+     * @param other - the TripleTree to swap with.
+     */
+    void swap(TripleTree& other) noexcept;
+
     /* =============== end of given functions ====================*/
 
     /* =============== public PA3 FUNCTIONS =========================*/
@@ -88,6 +175,105 @@ public:
      */
     TripleTree(PNG& imIn);
 
+    /**
+     * Constructor that builds the same TripleTree as building from the
+     * PNG and then calling Prune(tol), with the default metric, but never
+     * creates the nodes the prune would delete. Memory follows the size
+     * of the pruned tree rather than the number of pixels, apart from a
+     * summary of every split node's average of about a quarter of the
+     * size of a full tree, freed before the constructor returns. Time is
+     * not saved: every rectangle visited is compared pixel by pixel with
+     * its average, so a tree that prunes little costs O(pixels x depth),
+     * like building and then calling Prune.
+     *
+     * @param imIn - the input image used to construct the tree
+     * @param tol - maximum allowable color distance to qualify for pruning
+     */
+    TripleTree(PNG& imIn, double tol);
+
+    /**
+     * Constructor that builds a TripleTree top-down from a summed-area
+     * table of the PNG. A node's average is the mean of its pixels,
+     * truncated, so colors can differ by a level from TripleTree(PNG&).
+     * A rectangle whose var is at most tol is made a leaf; a negative tol
+     * builds the whole tree. An empty image gives an empty tree.
+     *
+     * A lazy tree builds a node's children the first time a query looks
+     * below it, and every missing node before anything that needs the
+     * whole tree. Its const members build nodes, so it must not be used
+     * by several threads at once. imIn and table must outlive the tree
+     * or a call to Expand, and a tree under the node budget for as long
+     * as it lives.
+     *
+     * @param imIn - the input image, which table must have been built from
+     * @param table - summed-area table of imIn
+     * @param tol - maximum mean squared color distance of a leaf, or negative
+     * @param lazy - whether to build nodes on first access
+     */
+    TripleTree(PNG& imIn, const SummedAreaTable& table, double tol, bool lazy = false);
+
+    /**
+     * Constructor that reads the tree written by WriteToFile, or as much
+     * of it as a partial buffer holds, from a MappedTripleTree. A lazy
+     * tree builds nodes from the file as the lazy summed-area tree does
+     * from its table, and under a node budget reads evicted subtrees from
+     * it again. file must outlive the tree or a call to Expand, and a
+     * tree under the node budget for as long as it lives.
+     *
+     * @param file - the mapped tree file
+     * @param lazy - whether to build nodes on first access
+     */
+    explicit TripleTree(const MappedTripleTree& file, bool lazy = false);
+
+    /**
+     * Builds every node a lazy tree has not built yet, after which it no
+     * longer refers to its image and table. Does nothing to other trees.
+     */
+    void Expand();
+
+    /**
+     * Sets the most nodes that lazy trees built from now on may hold
+     * between them, 0 for no limit, which is the default; other trees
+     * are not counted. After each render, query or Expand of such a
+     * tree, the least recently visited subtrees of 256 to 1024 pixels
+     * are collapsed to their average until the total fits, and built
+     * again when next visited. Render(), NumLeaves() and Write() also
+     * trim after each such subtree they finish, so they stay within the
+     * limit but for one subtree and the nodes above them; any other call
+     * may go over the limit while it runs. The trees share the budget, so
+     * they must all be used from one thread, and nothing is evicted while
+     * a RenderProgressive runs.
+     *
+     * @param nodes - node limit for budgeted trees, or 0
+     */
+    static void SetNodeBudget(size_t nodes);
+
+    /**
+     * Returns the number of nodes the trees under the node budget hold.
+     */
+    static size_t BudgetedNodes();
+
+    /**
+     * Returns the most nodes the trees under the node budget have held at
+     * once since SetNodeBudget was last called.
+     */
+    static size_t PeakBudgetedNodes();
+
+    /**
+     * Constructor that decodes PNG file bytes held in memory and builds
+     * a TripleTree out of the decoded image, without a temporary PNG
+     * file.
+     *
+     * If the bytes cannot be decoded, the error is printed and the tree
+     * is left empty: NumLeaves returns 0, renders are empty, ColorAt and
+     * AverageOver return a default pixel, and it may otherwise only be
+     * destroyed, assigned to or swapped.
+     *
+     * @param data - the encoded image
+     * @param size - the number of encoded bytes
+     */
+    TripleTree(const unsigned char* data, size_t size);
+
     /**
      * Render returns a PNG image consisting of the pixels
      * stored in the tree. It may be used on pruned trees. Draws
@@ -103,11 +289,74 @@ public:
      * Pruning criteria should be evaluated on the original tree, not
      * on a pruned subtree.
      *
+     * Colors are compared with Metric, one of the metrics in
+     * colormetric.h or any class with the same interface; the default
+     * is RGBAPixel::distanceTo. tol is in the metric's units, e.g.
+     * t.Prune<CIELab76>(2.3) prunes differences that are just noticeable.
      * 
-     * @param tol - maximum allowable RGBA color distance to qualify for pruning
+     * @param tol - maximum allowable color distance to qualify for pruning
      */
+    template <typename Metric = RGBADistance>
     void Prune(double tol);
 
+    /**
+     * Prunes subtrees as high as possible in the tree whose pixels are,
+     * on average, close to the subtree's average color: a subtree is
+     * pruned if the mean squared RGBA distance of its pixels from its
+     * average, with every channel in [0, 1], is at most tol. Unlike
+     * Prune, a few outlying pixels do not keep a region from being
+     * pruned.
+     *
+     * Each node's error is kept from the build, so the decision is
+     * constant time per node and the prune is a single pass over the
+     * nodes it keeps. sqrt(tol) is the root-mean-square distance, e.g.
+     * 0.0005 allows about 6 levels of every 8-bit channel.
+     *
+     * @param tol - maximum mean squared color distance to qualify for pruning
+     */
+    void PruneByVariance(double tol);
+
+    /**
+     * Prunes the subtrees that cost the least image quality, for as long
+     * as the peak signal-to-noise ratio of the render stays at or above
+     * targetPSNR. PSNR is 10 log10(1 / MSE), where MSE is the mean squared
+     * error of the render against the image over the red, green, blue and
+     * alpha channels, each in [0, 1]; e.g. 30 dB allows a root-mean-square
+     * error of about 8 levels of an 8-bit channel.
+     *
+     * The error a subtree adds when it is pruned follows from the error
+     * each node keeps from the build, so nothing is rendered: subtrees
+     * are collapsed bottom-up, cheapest first, stopping before the first
+     * one that would miss the target. Pruning
+     * continues from the current tree, so a tree already below the target
+     * is left as it is.
+     *
+     * @param targetPSNR - lowest acceptable PSNR, in decibels
+     * @return the PSNR of the pruned tree, or infinity if it is exact
+     */
+    double PruneToQuality(double targetPSNR);
+
+    /**
+     * Turns incremental pruning on or off. While it is on, Prune and
+     * PruneByVariance collapse subtrees instead of freeing them, so tol
+     * can be raised or lowered again without rebuilding from the image:
+     * the tree always looks exactly as if the unpruned tree had been
+     * pruned once with the latest tol. Each call only touches the nodes
+     * whose threshold, the smallest tol that prunes them, lies between
+     * the previous and the new tol.
+     *
+     * The first Prune after turning it on, or after switching metric or
+     * between Prune and PruneByVariance, computes every node's threshold,
+     * which takes about as long as pruning the whole tree. FlipHorizontal
+     * and RotateCCW also transform the collapsed subtrees. Copies of the
+     * tree get their own copy of its visible nodes, as if it had been
+     * pruned normally, and assigning to the tree turns the mode off.
+     * Turning it off frees the collapsed subtrees.
+     *
+     * @param on - whether to keep pruned subtrees
+     */
+    void SetIncrementalPrune(bool on);
+
     /**
      * Rearranges the tree contents so that when rendered, the image appears
      * to be mirrored horizontally (flipped over a vertical axis).
@@ -124,18 +373,161 @@ public:
     void RotateCCW();
 
     /**
-     * Returns the number of leaf nodes in the tree.
+     * Returns the number of leaf nodes in the tree, 0 if it is empty.
      *
      */
-    int NumLeaves() const;
+    uint64_t NumLeaves() const;
 
     /* =============== end of public PA3 FUNCTIONS =========================*/
 
+    /**
+     * Writes the tree to a file in the flat, breadth-first layout that
+     * MappedTripleTree maps for read-only serving.
+     *
+     * @param fileName - name of the file to be written.
+     * @return true, if the file was successfully written.
+     */
+    bool WriteToFile(const string& fileName) const;
+
+    /**
+     * Writes the tree to a stream in the same layout as WriteToFile.
+     * Nodes are written breadth-first, so a reader that has received
+     * only a prefix of the stream already holds every node down to
+     * some depth and can render a coarse preview from it.
+     *
+     * @param out - stream to write to.
+     * @return true, if the tree was successfully written.
+     */
+    bool Write(ostream& out) const;
+
+    /**
+     * Renders the tree as if every node at depth maxDepth were a leaf.
+     * The root is at depth 0, so Render(0) is a single rectangle of the
+     * image's average color. Each internal node's average is a valid
+     * preview of its region, which makes this a cheap thumbnail.
+     *
+     * @param maxDepth - deepest level of the tree to descend to.
+     */
+    PNG Render(int maxDepth) const;
+
+    /**
+     * Renders the tree coarse-to-fine. The canvas is first painted with
+     * the root, then each level of the tree is painted over its parents
+     * and the canvas is handed to emit after every level, ending with
+     * the same image as Render().
+     *
+     * @param emit - called with the depth just painted and the canvas.
+     */
+    void RenderProgressive(function<void(int, const PNG&)> emit) const;
+
+    /**
+     * Renders only the viewport with upper-left corner (x, y) and the
+     * given dimensions into a PNG of the viewport's size. Pixel (0, 0)
+     * of the result is pixel (x, y) of Render(). Only nodes whose
+     * rectangles intersect the viewport are visited, so the cost grows
+     * with the visible area rather than the image. Parts of the
+     * viewport outside the image are left at the default pixel.
+     *
+     * @param x - left edge of the viewport.
+     * @param y - top edge of the viewport.
+     * @param w - width of the viewport in pixels.
+     * @param h - height of the viewport in pixels.
+     */
+    PNG RenderRegion(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const;
+
+    /**
+     * Renders the tree at an arbitrary output resolution. Each node's
+     * rectangle is mapped into output space, and descent stops at leaves
+     * and at nodes that project inside a single output pixel; such a
+     * node's average is added to the output pixels it overlaps, weighted
+     * by the overlapping area. A node straddling output pixels is split,
+     * so the result is a box filter of Render(), up to the rounding of
+     * node averages, at a cost proportional to the output size plus the
+     * nodes visited rather than a full-size render followed by a resize.
+     *
+     * @param outWidth - width of the rendered image in pixels.
+     * @param outHeight - height of the rendered image in pixels.
+     */
+    PNG Render(unsigned int outWidth, unsigned int outHeight) const;
+
+    /**
+     * Returns a snapshot of this tree's counters together with the
+     * process-wide live node count and PNG encode/decode counters.
+     */
+    TreeStats Stats() const;
+
+    /**
+     * Sets this tree's counters back to zero.
+     */
+    void ResetStats();
+
+    /**
+     * Writes Stats() to a stream as a single JSON object.
+     *
+     * @param out - stream to write to.
+     */
+    void WriteStatsJSON(ostream& out) const;
+
+    /**
+     * Returns the color that Render() would give pixel (x, y), found by
+     * descending from the root in O(depth). Children are chosen by their
+     * current rectangles, so the answer follows any flips and rotations
+     * applied to the tree. Points outside the image get the default pixel.
+     *
+     * @param x - horizontal coordinate of the pixel.
+     * @param y - vertical coordinate of the pixel.
+     */
+    RGBAPixel ColorAt(unsigned int x, unsigned int y) const;
+
+    /**
+     * Returns the area-weighted average color that Render() would give
+     * the rectangle with upper-left corner (x, y) and the given
+     * dimensions, clipped to the image. Nodes entirely inside the
+     * rectangle contribute their stored average without being descended
+     * into, so the result can differ from averaging Render() by the
+     * rounding done when the tree was built; only nodes that straddle
+     * the border are recursed into. An empty intersection gives the
+     * default pixel.
+     *
+     * @param x - left edge of the rectangle.
+     * @param y - top edge of the rectangle.
+     * @param w - width of the rectangle in pixels.
+     * @param h - height of the rectangle in pixels.
+     */
+    RGBAPixel AverageOver(unsigned int x, unsigned int y, unsigned int w, unsigned int h) const;
+
 private:
     /**
      * Private member variables.
      */
     Node* root;	 // pointer to the root of the TripleTree
+    mutable TreeStats stats; // counters, only updated when built with TRIPLETREE_STATS
+
+    /**
+     * The counters const queries update, kept apart from stats because
+     * several threads may query one tree at once.
+     */
+    struct QueryStats {
+        atomic<uint64_t> pixelsFilled{0};
+        atomic<uint64_t> renderNanoseconds{0};
+
+        // takes over other's counts, leaving other at zero
+        void TakeFrom(QueryStats& other) {
+            pixelsFilled = other.pixelsFilled.exchange(0);
+            renderNanoseconds = other.renderNanoseconds.exchange(0);
+        }
+
+        void SwapWith(QueryStats& other) {
+            pixelsFilled = other.pixelsFilled.exchange(pixelsFilled);
+            renderNanoseconds = other.renderNanoseconds.exchange(renderNanoseconds);
+        }
+    };
+    mutable QueryStats queryStats;
+    struct Refinement;
+    Refinement* refinement; // collapsed subtrees while incremental pruning is on, or nullptr
+    struct LazySource;
+    mutable LazySource* lazy; // where a lazy tree builds missing children from, or nullptr
+    struct NodeBudget;
 
     /**
      * Destroys all dynamically allocated memory associated with the
@@ -144,40 +536,170 @@ private:
     void Clear();
 
     /**
-     * Copies the parameter other TripleTree into the current TripleTree.
-     * Does not free any memory. Called by copy constructor and operator=.
+     * Shares the nodes of the parameter other TripleTree with the current
+     * TripleTree. Does not free any memory. Called by copy constructor and
+     * operator=.
      * @param other - The TripleTree to be copied.
      */
     void Copy(const TripleTree& other);
 
     /**
-     * Private helper function for the constructor. Recursively builds
-     * the tree according to the specification of the constructor.
+     * Private helper function for the constructor. Builds the tree
+     * according to the specification of the constructor.
      * @param im - reference image used for construction
      * @param ul - upper left point of node to be built's rectangle.
      * @param w - width of node to be built's rectangle.
      * @param h - height of node to be built's rectangle.
      */
     Node* BuildNode(PNG& im, pair<unsigned int, unsigned int> ul, unsigned int w, unsigned int h);
+    Node* BuildPruned(PNG& im, double tol);
+    Node* LazyNode(pair<unsigned int, unsigned int> ul, unsigned int w, unsigned int h) const;
+    Node* SummedNode(pair<unsigned int, unsigned int> ul, unsigned int w, unsigned int h) const;
+    Node* FileNode(uint64_t index) const;
+    bool FileIndex(const Node* node, uint64_t& index) const;
+    void ExpandNode(Node* node) const;
+    void ExpandAll() const;
+    void trimmedWalk(int maxDepth, const function<void(Node*, int)>& visit) const;
+    void Detach();
+    void Visit(Node* node) const;
+    static NodeBudget& Budget();
+    static void ReleaseSource(LazySource* source);
+    static void Evict(LazySource* source, Node* node);
+    static void EvictToBudget();
+    void Trim() const;
+
+    // builds node's children if it belongs to a lazy tree and has not yet,
+    // and marks it as visited for the node budget
+    void Reach(Node* node) const {
+        if (lazy != nullptr) {
+            Visit(node);
+        }
+    }
 
     // added helper functions for all the functions above
     RGBAPixel FindAverage(Node* a, Node* b, Node* c);
     RGBAPixel FindAverage(Node* a, Node* c);
-    int leaves(Node* subroot) const;
+    uint64_t leaves(Node* subroot) const;
+    unsigned int height(Node* subRoot) const;
     void renderHelper(PNG &img, Node *subRoot) const;
+    void renderDepthHelper(PNG &img, Node *subRoot, int depth) const;
+    void fillHelper(PNG &img, Node *subRoot) const;
+    void regionHelper(PNG &img, Node *subRoot, unsigned int x, unsigned int y) const;
+    void averageHelper(double *sum, Node *subRoot, unsigned int x, unsigned int y, unsigned int w, unsigned int h) const;
+    void scaledHelper(vector<double> &acc, Node *subRoot, unsigned int outW, unsigned int outH, double sx, double sy) const;
     void clearHelper(Node* subRoot);
-    Node* CopyHelper(Node* other);
+    void clearChildren(Node* subRoot, vector<Node*> &stack);
+    Node* CloneNode(Node* node);
+    Node* Unshare(Node*& slot);
     Node* FlipHorizontalHelper(Node*& subRoot); 
-    Node* MoveToRight(Node*& subRoot, unsigned int x); 
-    Node* MoveToLeft(Node*& subRoot, unsigned int x); 
     Node* RotateCCWHelper(Node*& subRoot);
-    Node* FlipVertical(Node*& subRoot);
-    Node* MoveDown(Node*& subRoot, unsigned int y);
-    Node* MoveUp(Node*& subRoot, unsigned int y);
-    Node* FlipHorizontalHelperRotate(Node*& subRoot);
-    Node* PruneHelper(Node* subRoot, double tol);
-    bool ShouldPrune(Node* subRoot, RGBAPixel avg, double tol);
+    typedef function<bool(Node* subRoot, RGBAPixel avg, double tol, vector<Node*> &stack)> PruneTest;
+    Node* PruneHelper(Node* subRoot, double tol, const PruneTest& shouldPrune);
+    bool VarianceWithin(Node* subRoot, RGBAPixel avg, double tol, vector<Node*> &stack);
+    double ChooseCollapses(double targetPSNR, vector<Node*> &collapsing);
+    typedef double (TripleTree::*PruneThreshold)(Node* subRoot, vector<Node*> &stack);
+    void RefineTo(double tol, PruneThreshold threshold);
+    void Toggle(double tol);
+    Node* DeepCopy(Node* subRoot);
+    template <typename Metric>
+    double MaxDistance(Node* subRoot, vector<Node*> &stack);
+    double VarianceThreshold(Node* subRoot, vector<Node*> &stack);
+    template <typename Metric>
+    bool ShouldPrune(Node* subRoot, RGBAPixel avg, double tol, vector<Node*> &stack);
 
 };
 
+/**
+ * Prune is a template so that the metric is inlined into ShouldPrune's
+ * leaf loop; PruneHelper calls it once per internal node it visits.
+ */
+template <typename Metric>
+void TripleTree::Prune(double tol) {
+    INSTRUMENT_TIMER(timer, stats.pruneSeconds);
+    Detach();
+    if (refinement != nullptr) {
+        RefineTo(tol, &TripleTree::MaxDistance<Metric>);
+        return;
+    }
+    root = PruneHelper(root, tol, [this](Node* subRoot, RGBAPixel avg, double tol, vector<Node*> &stack) {
+        return ShouldPrune<Metric>(subRoot, avg, tol, stack);
+    });
+}
+
+/**
+ * Helper function to determine whether Node should be pruned based of tolerance
+ * and leaves. Leaves are tested in A, B, C order and the walk stops at the
+ * first leaf out of tolerance.
+ * 
+ * @param subRoot - pointer to Node containing Triple Tree structure
+ * @param avg - pixel to compare to
+ * @param tol - maximum color distance under Metric
+ * @param stack - scratch traversal stack, reused between calls
+ */
+template <typename Metric>
+bool TripleTree::ShouldPrune(Node* subRoot, RGBAPixel avg, double tol, vector<Node*> &stack) {
+    typename Metric::Color reference = Metric::Convert(avg);
+    stack.clear();
+    stack.push_back(subRoot);
+    while (!stack.empty()) {
+        Node *node = stack.back();
+        stack.pop_back();
+        if (node->A == nullptr && node->B == nullptr && node->C == nullptr) {
+            // leaf node
+            INSTRUMENT(stats.pruneLeafVisits++; stats.distanceCalls++);
+            if (Metric::Distance(Metric::Convert(node->avg), reference) > tol) {
+                stack.clear();
+                return false;
+            }
+        } else {
+            // not leaf node, children pushed C first so they are tested A, B, C
+            stack.push_back(node->C);
+            if (node->B != nullptr) {
+                stack.push_back(node->B);
+            }
+            stack.push_back(node->A);
+        }
+    }
+    return true;
+}
+
+/**
+ * Threshold of a node for incremental pruning with Metric: the largest
+ * distance of any leaf below it from its average, so that Prune<Metric>
+ * prunes it exactly when tol is at least this.
+ *
+ * @param subRoot - split node to measure
+ * @param stack - scratch traversal stack, reused between calls
+ */
+template <typename Metric>
+double TripleTree::MaxDistance(Node* subRoot, vector<Node*> &stack) {
+    typename Metric::Color reference = Metric::Convert(subRoot->avg);
+    double worst = 0;
+    stack.clear();
+    stack.push_back(subRoot);
+    while (!stack.empty()) {
+        Node *node = stack.back();
+        stack.pop_back();
+        if (node->A == nullptr && node->B == nullptr && node->C == nullptr) {
+            INSTRUMENT(stats.pruneLeafVisits++; stats.distanceCalls++);
+            worst = max(worst, Metric::Distance(Metric::Convert(node->avg), reference));
+        } else {
+            stack.push_back(node->C);
+            if (node->B != nullptr) {
+                stack.push_back(node->B);
+            }
+            stack.push_back(node->A);
+        }
+    }
+    return worst;
+}
+
+/**
+ * Exchanges two trees in constant time, found by argument-dependent
+ * lookup from generic code.
+ */
+inline void swap(TripleTree& a, TripleTree& b) noexcept {
+    a.swap(b);
+}
+
 #endif
\ No newline at end of file